@@ -1,233 +1,789 @@
 #include <chrono>
-#include <complex>
-#include <future>
+#include <csignal>
+#include <ctime>
 #include <iostream>
 #include <png++/png.hpp>
-#include <random>
-#include <thread>
-#include <vector>
-
-using idx = std::ptrdiff_t;
-using pt = std::complex<double>;  // a point in real life
-using px = std::pair<idx, idx>;   // pixel in the image
-
-class buddhabrot {
-   private:
-    static constexpr double escape_radius2 = 8.0;
-    const idx image_size;
-    const idx iterations;
-    const idx max_samples;
-    const idx stride;
-    const idx stride_offset;
-    std::vector<std::vector<double>> image;
-    std::vector<std::vector<pt>> buf;
-    std::vector<idx> buflen;
-    std::mt19937 engine;
+#include <sstream>
+#include <sys/wait.h>
 
-    /**
-     * struct to represent a bounding box
-     */
-    struct bounds {
-        double ulo, uhi, vlo, vhi;
-    };
+#include "buddhabrot.hpp"
+#include "expression.hpp"
+#include "farm.hpp"
+#include "frames.hpp"
+#include "live.hpp"
+#include "service.hpp"
+#include "tiff.hpp"
+#include "trajectories.hpp"
+
+using namespace buddha;
+
+template <typename Importance, typename Formula = mandelbrot_formula>
+using renderer = buddhabrot<Formula, uniform_sampler, buffer_accumulator,
+                            strided_scheduler, Importance>;
+template <typename Importance>
+using farm_renderer = buddhabrot<mandelbrot_formula, uniform_sampler,
+                                 vector_accumulator, pull_scheduler, Importance>;
+template <typename Importance, typename Formula = mandelbrot_formula>
+using sweep_renderer = buddhabrot<Formula, uniform_sampler, band_accumulator,
+                                  strided_scheduler, Importance>;
+
+/**
+ * how to turn a render into output
+ */
+struct output_settings {
+    double denoise_strength = 0;
+    std::vector<idx> scales;  // also write images downscaled by these
+    bool fold = true;         // fold about the real axis
+    idx tiff_bits = 0;  // 16 or 32 to write tiled TIFFs instead of PNGs
+    frame_stream* frames = nullptr;  // stream raw frames here instead
+};
+
+/**
+ * settings from the command line
+ */
+struct options {
+    idx image_size, iterations, n_threads, max_samples;
+    output_settings output;
+    std::string raw, raw_format = "gray16le";
+    render_settings settings;
+    bool stats = false;
+    std::string importance = "path";
+    std::string coordinator, worker, save, refine, shm, trajectories, formula;
+    bool trajectory_points = false;
+    bool shm_overwrite = false;
+    idx passes = 1;
+    idx sweep = 0;
+
+    std::string filename() const { return filename(iterations); }
 
     /**
-     * sample a random point within bounding box
+     * the name of an image rendered with the given iteration limit
      */
-    pt random_pt(const bounds& bb) {
-        std::uniform_real_distribution<double> uniform_dist_real(bb.ulo,
-                                                                 bb.uhi);
-        std::uniform_real_distribution<double> uniform_dist_imag(bb.vlo,
-                                                                 bb.vhi);
-        return pt(uniform_dist_real(engine), uniform_dist_imag(engine));
+    std::string filename(const idx limit) const {
+        std::stringstream filename_ss;
+        filename_ss << (settings.julia ? "julia_" : "buddhabrot_")
+                    << image_size << "_" << limit << "_" << max_samples
+                    << ".png";
+        return filename_ss.str();
     }
+};
 
-    /**
-     * convert point to pixel
-     */
-    px to_px(const pt z) {
-        return std::make_pair(
-            static_cast<idx>(image_size * (z.real() + 2) / 4),
-            static_cast<idx>(image_size * (z.imag() + 2) / 4));
+/**
+ * a fresh seed for the i-th renderer of this process
+ */
+idx make_seed(const idx i) {
+    std::random_device rd;
+    return std::chrono::steady_clock::now().time_since_epoch().count() + i +
+           rd() + ::getpid();
+}
+
+/**
+ * tone map a square image and write it to a 16-bit grayscale png file.
+ * Returns false if the file can't be written.
+ */
+bool write_png(const std::string& filename, const std::vector<double>& image,
+               const idx image_size, const value_range& range,
+               const idx n_threads) {
+    png::image<png::gray_pixel_16> pimage(image_size, image_size);
+    parallel_for(n_threads, image_size, [&](idx u) {
+        for (idx v = 0; v < image_size; v++) {
+            pimage[u][v] = png::gray_pixel_16(
+                ((1 << 16) - 1) * tone_map(image[u * image_size + v], range));
+        }
+    });
+    try {
+        pimage.write(filename);
+    } catch (const std::exception& e) {
+        std::cerr << "could not write " << filename << ": " << e.what()
+                  << std::endl;
+        return false;
     }
+    return true;
+}
 
-    /**
-     * convert pixel to point
-     */
-    pt to_pt(const px x) {
-        return pt(x.first * 4.0 / image_size - 2.0,
-                  x.second * 4.0 / image_size - 2.0);
+/**
+ * tone map a square image and write it to a png file, or to a tiled TIFF
+ * with tiff_bits bits per sample if that isn't 0. The .png extension of
+ * filename is replaced by .tif for TIFFs. Returns false on failure.
+ */
+bool write_image(const std::string& filename, const std::vector<double>& image,
+                 const idx image_size, const value_range& range,
+                 const idx n_threads, const idx tiff_bits) {
+    if (tiff_bits == 0) {
+        return write_png(filename, image, image_size, range, n_threads);
+    }
+    const std::string tiff_filename =
+        filename.substr(0, filename.rfind(".png")) + ".tif";
+    if (!write_tiff(tiff_filename, image_size, image_size, tiff_bits,
+                    n_threads, [&](idx u, idx v) {
+                        return tone_map(image[u * image_size + v], range);
+                    })) {
+        std::cerr << "could not write " << tiff_filename << std::endl;
+        return false;
     }
+    return true;
+}
 
-    /**
-     * check if a pixel is within bounds of the image
-     */
-    bool in_bounds(px y) {
-        return y.first >= 0 && y.second >= 0 && y.first < image_size &&
-               y.second < image_size;
+/**
+ * combine the buddhabrots from all the different threads
+ * and write them to a png file, plus one downscaled png for each of scales,
+ * named with a _d<scale> suffix, as set out by output. With output.frames,
+ * the image is only sent to that stream as the next frame.
+ * Returns false on failure.
+ */
+template <typename Brot>
+bool write(const std::string& filename,
+           const std::vector<std::unique_ptr<Brot>>& brots,
+           const idx image_size, const idx n_threads,
+           const output_settings& output) {
+    std::vector<double> merged;
+    const value_range range =
+        merge(brots, image_size, n_threads, merged, output.fold);
+
+    if (output.denoise_strength > 0) {
+        denoise(merged, image_size, n_threads, output.denoise_strength);
     }
 
-    /**
-     * Render a region within bounding box
-     *
-     * This is an adaptive sampling algorithm that uses importance sampling.
-     * The importance of the box is assumed to be 10 * the max path length
-     * originating from a point in the region.
-     *
-     * As we continue to sample, we keep updating the importance of the region
-     * as needed.
-     *
-     * For example, for points in the Mandelbrot set, after 5 samples, it will
-     * immediately terminate. However, interesting points tend to be on the
-     * edges of the set. So, cells that contain points both in and out of the
-     * Mandelbrot set will be considered to have maximum importance.
-     */
-    void render_region(const bounds& bb) {
-        idx samples = 5;
-        idx max_path = -1;
-        for (idx trial = 0; trial < samples; trial++) {
-            auto c = random_pt(bb);
-            pt z(0, 0);
-            idx escaped_time = 0;
-            for (idx i = 0; i < iterations; i++) {
-                z = z * z + c;
-                buf[trial][i] = z;
-                if (z.imag() * z.imag() + z.real() * z.real() >
-                    escape_radius2) {
-                    escaped_time = i;
-                    break;
+    if (output.frames) {
+        if (!output.frames->add(merged, range, n_threads)) {
+            std::cerr << "could not write frame" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if (!write_image(filename, merged, image_size, range, n_threads,
+                     output.tiff_bits)) {
+        return false;
+    }
+
+    // the downscaled images share the full image's range, so that they are
+    // tone mapped the same way
+    const auto& scales = output.scales;
+    const auto small = downsample(merged, image_size, n_threads, scales);
+    const std::string stem = filename.substr(0, filename.rfind(".png"));
+    for (std::size_t k = 0; k < scales.size(); k++) {
+        std::stringstream small_ss;
+        small_ss << stem << "_d" << scales[k] << ".png";
+        if (!write_image(small_ss.str(), small[k], image_size / scales[k],
+                         range, n_threads, output.tiff_bits)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * run one connection to a farm coordinator
+ */
+template <typename Importance>
+bool run_worker(const options& opt, const std::string& host, const int port,
+                const idx seed) {
+    const int fd = farm_connect(host, port);
+    if (fd < 0) {
+        std::cerr << "could not connect to " << host << ":" << port
+                  << std::endl;
+        return false;
+    }
+    const bool ok = farm_worker(
+        fd, opt.image_size, opt.iterations, opt.max_samples, opt.settings,
+        [&](pull_scheduler scheduler) {
+            return std::make_unique<farm_renderer<Importance>>(
+                opt.image_size, opt.iterations, opt.max_samples,
+                uniform_sampler(seed), vector_accumulator(opt.image_size),
+                std::move(scheduler), opt.settings);
+        });
+    ::close(fd);
+    return ok;
+}
+
+template <typename Importance>
+int run_farm(const options& opt) {
+    std::string host;
+    int port;
+    if (!opt.worker.empty()) {
+        if (!parse_address(opt.worker, host, port)) {
+            std::cerr << "bad address " << opt.worker << std::endl;
+            return 1;
+        }
+        std::atomic<bool> ok(true);
+        std::vector<std::thread> threads;
+        for (idx i = 0; i < opt.n_threads; i++) {
+            threads.emplace_back([&, i]() {
+                if (!run_worker<Importance>(opt, host, port, make_seed(i))) {
+                    ok = false;
                 }
-            }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        return ok ? 0 : 1;
+    }
 
-            // the longer the path, the higher the importance.
-            if (escaped_time > max_path) {
-                max_path = escaped_time;
-                samples = std::max(
-                    samples,
-                    std::min(max_samples, 5 + 2 * max_path * max_path));
-            }
+    if (!parse_address(opt.coordinator, host, port)) {
+        std::cerr << "bad address " << opt.coordinator << std::endl;
+        return 1;
+    }
+    const int listen_fd = farm_listen(host, port);
+    if (listen_fd < 0) {
+        std::cerr << "could not listen on " << opt.coordinator << std::endl;
+        return 1;
+    }
+    std::vector<pid_t> children;
+    for (idx i = 0; i < opt.n_threads; i++) {
+        const pid_t pid = ::fork();
+        if (pid == 0) {
+            ::close(listen_fd);
+            ::_exit(run_worker<Importance>(opt, host, port, make_seed(i)) ? 0
+                                                                          : 1);
+        }
+        children.push_back(pid);
+    }
+    std::vector<std::unique_ptr<vector_accumulator>> merged;
+    merged.emplace_back(std::make_unique<vector_accumulator>(opt.image_size));
+    const bool ok =
+        farm_coordinator(listen_fd, opt.image_size, opt.iterations,
+                         opt.max_samples, opt.settings, merged[0]->data());
+    ::close(listen_fd);
+    for (const pid_t pid : children) {
+        ::waitpid(pid, nullptr, 0);
+    }
+    if (!ok) {
+        return 1;
+    }
+    if (!opt.save.empty() &&
+        !save_accumulator(opt.save,
+                          make_accumulator_header(
+                              opt.image_size, opt.iterations, opt.max_samples,
+                              opt.settings, opt.formula, opt.output.fold, 1),
+                          merged[0]->data())) {
+        std::cerr << "could not save " << opt.save << std::endl;
+        return 1;
+    }
+    return write(opt.filename(), merged, opt.image_size,
+                 std::max<idx>(1, opt.n_threads), opt.output)
+               ? 0
+               : 1;
+}
 
-            // if we encounter the edge of the mandelbrot set, we treat this as
-            // the maximum importance.
-            if ((escaped_time == 0 && max_path > 0) ||
-                (escaped_time != 0 && max_path == -1)) {
-                samples = max_samples;
+/**
+ * render on this machine and write the result
+ */
+template <typename Importance, typename Formula>
+int run_local(const options& opt, const Formula& formula) {
+    const idx image_size = opt.image_size;
+    const idx n_threads = opt.n_threads;
+    std::string save = opt.save;
+    output_settings output = opt.output;
+    output.fold = output.fold && formula.conjugate_symmetric();
+
+    const accumulator_header wanted =
+        make_accumulator_header(image_size, opt.iterations, opt.max_samples,
+                                opt.settings, opt.formula, output.fold, 0);
+    accumulator_header header = wanted;
+    std::vector<double> prior;
+    if (!opt.refine.empty()) {
+        if (!load_accumulator(opt.refine, header, prior)) {
+            std::cerr << "could not load " << opt.refine << std::endl;
+            return 1;
+        }
+        // passes are only equivalent if they were sampled the same way, from
+        // the same image
+        if (!same_render(header, wanted)) {
+            std::cerr << opt.refine << " was rendered at size "
+                      << header.image_size << " with " << header.iterations
+                      << " iterations, " << header.max_samples
+                      << " max samples per pixel and " << header.min_iterations
+                      << " min iterations"
+                      << (header.bilinear ? ", bilinear" : "");
+            if (header.julia) {
+                std::cerr << ", as the Julia set of " << header.julia_re << ","
+                          << header.julia_im;
             }
+            if (header.formula != wanted.formula) {
+                std::cerr << (header.formula ? ", with a different formula"
+                                             : ", without --formula");
+            }
+            std::cerr << std::endl;
+            return 1;
+        }
+        header.fold = wanted.fold;
+        if (save.empty()) {
+            save = opt.refine;
+        }
+    }
 
-            buflen[trial] = escaped_time;
+    // each thread's image, either in private memory or in a shared memory
+    // segment that other processes can watch
+    std::vector<std::vector<double>> planes;
+    std::unique_ptr<live_segment> live;
+    if (!opt.shm.empty()) {
+        live = std::make_unique<live_segment>(opt.shm, image_size, n_threads,
+                                              opt.shm_overwrite);
+        if (!*live) {
+            std::cerr << "could not create shared memory " << opt.shm
+                      << (errno == EEXIST ? ": it already exists, use "
+                                            "--shm-overwrite to replace it"
+                                          : "")
+                      << std::endl;
+            return 1;
         }
+        live->header->cells_total = image_size * image_size * opt.passes;
+    } else {
+        planes.assign(n_threads, std::vector<double>(image_size * image_size));
+    }
+
+    std::vector<std::unique_ptr<renderer<Importance, Formula>>> brots;
+    for (idx i = 0; i < n_threads; i++) {
+        double* plane = live ? live->plane(i) : planes[i].data();
+        brots.emplace_back(std::make_unique<renderer<Importance, Formula>>(
+            image_size, opt.iterations, opt.max_samples,
+            uniform_sampler(make_seed(i)), buffer_accumulator(plane, image_size),
+            strided_scheduler{n_threads, i}, opt.settings, formula));
+    }
 
-        const double weight = 1.0 / samples;
-        for (idx trial = 0; trial < samples; trial++) {
-            for (idx i = 0; i < buflen[trial]; i++) {
-                px y = to_px(buf[trial][i]);
-                if (in_bounds(y)) image[y.first][y.second] += weight;
+    std::vector<std::unique_ptr<trajectory_writer>> writers;
+    if (!opt.trajectories.empty()) {
+        for (idx i = 0; i < n_threads; i++) {
+            std::stringstream trajectories_ss;
+            trajectories_ss << opt.trajectories << "_" << i << ".bin";
+            writers.emplace_back(std::make_unique<trajectory_writer>(
+                trajectories_ss.str(), opt.trajectory_points));
+            if (!*writers[i]) {
+                std::cerr << "could not open " << trajectories_ss.str()
+                          << std::endl;
+                return 1;
             }
+            brots[i]->set_orbit_callback(
+                [w = writers[i].get()](pt c, double weight, const pt* points,
+                                       idx n) { w->add(c, weight, points, n); });
         }
     }
 
-   public:
-    buddhabrot(const idx image_size_, const idx iterations_,
-               const idx max_samples_, const idx seed, const idx stride_ = 1,
-               const idx stride_offset_ = 0)
-        : image_size(image_size_),
-          iterations(iterations_),
-          max_samples(max_samples_),
-          stride(stride_),
-          stride_offset(stride_offset_),
-          image(image_size, std::vector<double>(image_size, 0)),
-          buf(max_samples, std::vector<pt>(iterations)),
-          buflen(max_samples),
-          engine(seed) {}
-
-    void render() {
-        for (idx u = stride_offset; u < image_size; u += stride) {
-            for (idx v = 0; v < image_size; v++) {
-                pt a = to_pt(std::make_pair(u, v));
-                pt b = to_pt(std::make_pair(u + 1, v + 1));
-                render_region(bounds{a.real(), b.real(), a.imag(), b.imag()});
+    // publish progress to the live segment a few times a second
+    std::atomic<bool> rendering(true);
+    auto publish = [&]() {
+        idx cells = 0, samples = 0;
+        for (auto& b : brots) {
+            cells += b->cells_rendered();
+            samples += b->orbits_sampled();
+        }
+        live->update_sum();
+        live->header->cells_done = cells;
+        live->header->samples = samples;
+        live->header->generation++;
+    };
+    std::thread publisher;
+    if (live) {
+        publisher = std::thread([&]() {
+            using clock = std::chrono::steady_clock;
+            clock::duration wait = std::chrono::milliseconds(100);
+            while (rendering) {
+                std::this_thread::sleep_for(wait);
+                const auto start = clock::now();
+                publish();
+                // summing big images takes a while, so keep it to about a
+                // tenth of a core
+                wait = std::max<clock::duration>(std::chrono::milliseconds(100),
+                                                 9 * (clock::now() - start));
             }
+        });
+    }
+
+    const auto wall_start = std::chrono::steady_clock::now();
+    const std::clock_t cpu_start = std::clock();
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads);
+    for (idx i = 0; i < n_threads; i++) {
+        threads.emplace_back([=, &brots]() {
+            for (idx pass = 0; pass < opt.passes; pass++) {
+                brots[i]->render();
+            }
+        });
+    }
+    for (idx i = 0; i < n_threads; i++) {
+        threads[i].join();
+    }
+    // stop the publisher before anything can return early
+    if (live) {
+        rendering = false;
+        publisher.join();
+        live->header->finished = 1;
+        publish();
+    }
+    for (auto& w : writers) {
+        if (!w->close()) {
+            std::cerr << "could not write all trajectories" << std::endl;
+            return 1;
+        }
+    }
+    if (opt.stats) {
+        const double cpu_seconds =
+            static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+        const double wall_seconds = std::chrono::duration<double>(
+                                        std::chrono::steady_clock::now() -
+                                        wall_start)
+                                        .count();
+        std::cerr << "render: " << wall_seconds << " s wall, " << cpu_seconds
+                  << " s cpu" << std::endl;
+        const double noise = estimate_noise(brots, image_size);
+        if (noise > 0) {
+            std::cerr << "noise: " << noise << ", quality per cpu-second: "
+                      << 1.0 / (noise * noise * cpu_seconds) << std::endl;
+        } else {
+            std::cerr << "noise: needs at least 2 threads" << std::endl;
         }
     }
+    if (save.empty()) {
+        return write(opt.filename(), brots, image_size, n_threads, output) ? 0
+                                                                           : 1;
+    }
 
-    double operator()(idx u, idx v) const { return image[u][v]; }
-};
+    std::vector<std::unique_ptr<vector_accumulator>> total;
+    total.emplace_back(std::make_unique<vector_accumulator>(image_size));
+    combine_passes(brots, image_size, n_threads,
+                   prior.empty() ? nullptr : prior.data(), header.passes,
+                   opt.passes, total[0]->data());
+    prior = std::vector<double>();
+    brots.clear();
+    header.passes += opt.passes;
+    if (!save_accumulator(save, header, total[0]->data())) {
+        std::cerr << "could not save " << save << std::endl;
+        return 1;
+    }
+    std::cerr << save << " now holds " << header.passes << " passes"
+              << std::endl;
+    return write(opt.filename(), total, image_size, n_threads, output) ? 0 : 1;
+}
 
 /**
- * combine the buddhabrots from all the different threads
- * and write them to a png file
+ * render once at the full iteration limit, and write one frame for each of
+ * opt.sweep evenly spaced limits up to it, as if each had been rendered
+ * separately. Each frame adds the next escape time band to the previous one.
  */
-void write(const std::string& filename,
-           const std::vector<std::unique_ptr<buddhabrot>>& brots,
-           const idx image_size) {
-    double max_val = 0;
-    double min_val = std::numeric_limits<double>::infinity();
-    for (idx u = 0; u < image_size; u++) {
-        for (idx v = 0; v < image_size; v++) {
-            double x = 0;
-            for (auto& b : brots) {
-                x += (*b)(u, v);
-            }
-            if (x < min_val) {
-                min_val = x;
+template <typename Importance, typename Formula>
+int run_sweep(const options& opt, const Formula& formula) {
+    const idx image_size = opt.image_size;
+    const idx n_threads = opt.n_threads;
+    output_settings output = opt.output;
+    output.fold = output.fold && formula.conjugate_symmetric();
+    std::vector<idx> limits;
+    for (idx k = 1; k <= opt.sweep; k++) {
+        const idx limit = opt.iterations * k / opt.sweep;
+        if (limits.empty() || limit > limits.back()) {
+            limits.push_back(limit);
+        }
+    }
+
+    std::vector<std::unique_ptr<sweep_renderer<Importance, Formula>>> brots;
+    for (idx i = 0; i < n_threads; i++) {
+        brots.emplace_back(std::make_unique<sweep_renderer<Importance, Formula>>(
+            image_size, opt.iterations, opt.max_samples,
+            uniform_sampler(make_seed(i)), band_accumulator(image_size, limits),
+            strided_scheduler{n_threads, i}, opt.settings, formula));
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads);
+    for (idx i = 0; i < n_threads; i++) {
+        threads.emplace_back([=, &brots]() {
+            for (idx pass = 0; pass < opt.passes; pass++) {
+                brots[i]->render();
             }
-            if (x > max_val) {
-                max_val = x;
+        });
+    }
+    for (idx i = 0; i < n_threads; i++) {
+        threads[i].join();
+    }
+
+    std::vector<std::unique_ptr<vector_accumulator>> frame;
+    frame.emplace_back(std::make_unique<vector_accumulator>(image_size));
+    double* sum = frame[0]->data();
+    for (std::size_t k = 0; k < limits.size(); k++) {
+        parallel_for(n_threads, image_size, [&](idx u) {
+            for (auto& b : brots) {
+                const double* band = b->accumulator().band(k) + u * image_size;
+                for (idx v = 0; v < image_size; v++) {
+                    sum[u * image_size + v] += band[v];
+                }
             }
+        });
+        if (!write(opt.filename(limits[k]), frame, image_size, n_threads,
+                   output)) {
+            return 1;
         }
     }
+    return 0;
+}
 
-    png::image<png::gray_pixel_16> pimage(image_size, image_size);
-    for (idx u = 0; u < image_size; u++) {
-        for (idx v = 0; v < image_size; v++) {
-            double x = 0;
-            for (auto& b : brots) {
-                x += (*b)(u, v);
-                x += (*b)(u, image_size - 1 - v);
+template <typename Importance>
+int run(const options& opt) {
+    if (!opt.worker.empty() || !opt.coordinator.empty()) {
+        return run_farm<Importance>(opt);
+    }
+    if constexpr (!Importance::needs_distance) {
+        if (!opt.formula.empty()) {
+            const expression_formula formula(opt.formula);
+            if (!formula) {
+                std::cerr << "bad formula: " << formula.error_message()
+                          << std::endl;
+                return 1;
             }
-            pimage[u][v] = png::gray_pixel_16(
-                ((1 << 16) - 1) *
-                std::sqrt((x * 0.5 - min_val) / (max_val - min_val)));
+            return opt.sweep > 0 ? run_sweep<Importance>(opt, formula)
+                                 : run_local<Importance>(opt, formula);
         }
     }
-    pimage.write(filename);
+    const mandelbrot_formula formula;
+    return opt.sweep > 0 ? run_sweep<Importance>(opt, formula)
+                         : run_local<Importance>(opt, formula);
 }
 
 int main(int argc, char** argv) {
-    if (argc != 5) {
+    if (argc == 4 && std::string(argv[1]) == "--serve") {
+        render_service service(
+            std::atoi(argv[3]), [](const std::string& filename,
+                                   const auto& brots, const idx image_size,
+                                   const idx n_threads, const double denoise) {
+                output_settings output;
+                output.denoise_strength = denoise;
+                return write(filename, brots, image_size, n_threads, output);
+            });
+        if (!service.serve(argv[2])) {
+            std::cerr << "could not listen on " << argv[2] << std::endl;
+        }
+        return 1;
+    }
+    if (argc < 5) {
         std::cerr << "USAGE: buddhabrot image_size iterations num_threads "
-                     "max_samples_per_pixel\n"
-                  << "example: buddhabrot 1024 1000 12 64" << std::endl;
+                     "max_samples_per_pixel [options]\n"
+                  << "       buddhabrot --serve socket_path num_threads\n"
+                  << "example: buddhabrot 1024 1000 12 64\n"
+                  << "options:\n"
+                  << "  --denoise strength   edge-preserving denoise before "
+                     "tone mapping (try 1.0)\n"
+                  << "  --bilinear           splat orbit points with a tent "
+                     "filter instead of nearest pixel\n"
+                  << "  --roulette p         only render cells that look "
+                     "boring from their first\n"
+                  << "                       pilot with probability p, "
+                     "weighted by 1 / p\n"
+                  << "  --min-iterations k   leave out orbits that escape in "
+                     "fewer than k iterations\n"
+                  << "  --julia re,im        render the orbits of the Julia "
+                     "set of c = re + im i\n"
+                  << "  --formula f          iterate z -> f instead of z^2 + "
+                     "c, e.g. \"z^3 - z + c\"\n"
+                  << "  --importance path|de how to decide the samples per "
+                     "cell: path length (default)\n"
+                  << "                       or distance estimator\n"
+                  << "  --huge-pages         back orbit buffers with "
+                     "transparent huge pages\n"
+                  << "                       (experimental)\n"
+                  << "  --stats              print render time and noise "
+                     "estimate\n"
+                  << "  --coordinator [host:]port\n"
+                  << "                       hand out rows to farm workers "
+                     "and merge their results,\n"
+                  << "                       forking num_threads local "
+                     "workers (may be 0)\n"
+                  << "  --worker host:port   render rows for a coordinator "
+                     "on num_threads threads\n"
+                  << "  --passes n           render n independent passes "
+                     "over the grid\n"
+                  << "  --save file          also save the linear accumulator "
+                     "to file\n"
+                  << "  --refine file        add passes to the accumulator "
+                     "saved in file and update it\n"
+                  << "  --scales 2,4,8       also write images downscaled by "
+                     "these factors\n"
+                  << "  --tiff 16|32         write tiled BigTIFFs with 16-bit "
+                     "or float samples instead\n"
+                  << "                       of PNGs\n"
+                  << "  --raw path           stream raw frames to path (- for "
+                     "stdout) instead of\n"
+                  << "                       writing images\n"
+                  << "  --raw-format f       gray16le (default) or rgb48le\n"
+                  << "  --shm name           render into a POSIX shared "
+                     "memory segment that other\n"
+                  << "                       processes can watch\n"
+                  << "  --shm-overwrite      replace an existing segment of "
+                     "that name\n"
+                  << "  --trajectories prefix\n"
+                  << "                       stream escaping orbits to "
+                     "prefix_<thread>.bin\n"
+                  << "  --trajectory-points  include the orbit points in "
+                     "the streamed trajectories\n"
+                  << "  --sweep n            write n frames with iteration "
+                     "limits evenly spaced up to\n"
+                  << "                       iterations, from a single render"
+                  << std::endl;
         return 1;
     }
 
-    const idx image_size = std::atoi(argv[1]);
-    const idx iterations = std::atoi(argv[2]);
-    const idx n_threads = std::atoi(argv[3]);
-    const idx max_samples = std::atoi(argv[4]);
+    options opt;
+    opt.image_size = std::atoi(argv[1]);
+    opt.iterations = std::atoi(argv[2]);
+    opt.n_threads = std::atoi(argv[3]);
+    opt.max_samples = std::atoi(argv[4]);
 
-    std::vector<std::unique_ptr<buddhabrot>> brots;
-    for (idx i = 0; i < n_threads; i++) {
-        std::random_device rd;
-        auto seed =
-            std::chrono::steady_clock::now().time_since_epoch().count() + i +
-            rd();
-        brots.emplace_back(std::make_unique<buddhabrot>(
-            image_size, iterations, max_samples, seed, n_threads, i));
+    for (int i = 5; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--denoise" && i + 1 < argc) {
+            opt.output.denoise_strength = std::atof(argv[++i]);
+        } else if (arg == "--bilinear") {
+            opt.settings.bilinear = true;
+        } else if (arg == "--roulette" && i + 1 < argc) {
+            opt.settings.roulette = std::atof(argv[++i]);
+            if (opt.settings.roulette <= 0 || opt.settings.roulette > 1) {
+                std::cerr << "roulette probability must be in (0, 1]"
+                          << std::endl;
+                return 1;
+            }
+        } else if (arg == "--min-iterations" && i + 1 < argc) {
+            opt.settings.min_iterations = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--julia" && i + 1 < argc) {
+            double re, im;
+            char comma;
+            std::stringstream julia_ss(argv[++i]);
+            if (!(julia_ss >> re >> comma >> im) || comma != ',') {
+                std::cerr << "--julia takes re,im" << std::endl;
+                return 1;
+            }
+            opt.settings.julia = true;
+            opt.settings.julia_c = pt(re, im);
+            // Julia sets of non-real c aren't symmetric about the real axis
+            opt.output.fold = false;
+        } else if (arg == "--formula" && i + 1 < argc) {
+            opt.formula = argv[++i];
+        } else if (arg == "--importance" && i + 1 < argc) {
+            opt.importance = argv[++i];
+            if (opt.importance != "path" && opt.importance != "de") {
+                std::cerr << "unknown importance " << opt.importance
+                          << std::endl;
+                return 1;
+            }
+        } else if (arg == "--huge-pages") {
+            opt.settings.huge_pages = true;
+        } else if (arg == "--stats") {
+            opt.stats = true;
+        } else if (arg == "--coordinator" && i + 1 < argc) {
+            opt.coordinator = argv[++i];
+        } else if (arg == "--worker" && i + 1 < argc) {
+            opt.worker = argv[++i];
+        } else if (arg == "--passes" && i + 1 < argc) {
+            opt.passes = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--save" && i + 1 < argc) {
+            opt.save = argv[++i];
+        } else if (arg == "--refine" && i + 1 < argc) {
+            opt.refine = argv[++i];
+        } else if (arg == "--shm" && i + 1 < argc) {
+            opt.shm = argv[++i];
+        } else if (arg == "--shm-overwrite") {
+            opt.shm_overwrite = true;
+        } else if (arg == "--trajectories" && i + 1 < argc) {
+            opt.trajectories = argv[++i];
+        } else if (arg == "--trajectory-points") {
+            opt.trajectory_points = true;
+        } else if (arg == "--sweep" && i + 1 < argc) {
+            opt.sweep = std::atoi(argv[++i]);
+            if (opt.sweep < 1) {
+                std::cerr << "sweep needs at least 1 frame" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--raw" && i + 1 < argc) {
+            opt.raw = argv[++i];
+        } else if (arg == "--raw-format" && i + 1 < argc) {
+            opt.raw_format = argv[++i];
+            if (opt.raw_format != "gray16le" && opt.raw_format != "rgb48le") {
+                std::cerr << "unknown raw format " << opt.raw_format
+                          << std::endl;
+                return 1;
+            }
+        } else if (arg == "--tiff" && i + 1 < argc) {
+            opt.output.tiff_bits = std::atoi(argv[++i]);
+            if (opt.output.tiff_bits != 16 && opt.output.tiff_bits != 32) {
+                std::cerr << "--tiff takes 16 or 32 bits" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--scales" && i + 1 < argc) {
+            std::stringstream scales_ss(argv[++i]);
+            std::string scale;
+            while (std::getline(scales_ss, scale, ',')) {
+                const idx f = std::atoi(scale.c_str());
+                if (f < 1 || f > opt.image_size) {
+                    std::cerr << "bad scale " << scale << std::endl;
+                    return 1;
+                }
+                opt.output.scales.push_back(f);
+            }
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
     }
 
-    std::vector<std::thread> threads;
-    threads.reserve(n_threads);
-    for (idx i = 0; i < n_threads; i++) {
-        threads.emplace_back([=, &brots]() { brots[i]->render(); });
+    if (opt.sweep > 0 &&
+        (!opt.save.empty() || !opt.refine.empty() || !opt.shm.empty() ||
+         !opt.trajectories.empty() || !opt.worker.empty() ||
+         !opt.coordinator.empty())) {
+        std::cerr << "--sweep only writes images, and can't be combined with "
+                     "--save, --refine, --shm, --trajectories or a farm"
+                  << std::endl;
+        return 1;
     }
-    for (idx i = 0; i < n_threads; i++) {
-        threads[i].join();
+
+    if (!opt.raw.empty() &&
+        (!opt.output.scales.empty() || opt.output.tiff_bits != 0)) {
+        std::cerr << "--raw only streams frames, and can't be combined with "
+                     "--scales or --tiff"
+                  << std::endl;
+        return 1;
     }
-    std::stringstream filename_ss;
-    filename_ss << "buddhabrot_" << image_size << "_" << iterations << "_"
-                << max_samples << ".png";
-    write(filename_ss.str(), brots, image_size);
-    return 0;
-}
 
+    if ((!opt.refine.empty() || opt.passes != 1 || !opt.shm.empty() ||
+         !opt.trajectories.empty() || opt.stats) &&
+        (!opt.worker.empty() || !opt.coordinator.empty())) {
+        std::cerr << "--refine, --passes, --shm, --trajectories and --stats "
+                     "can't be combined with a farm"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!opt.formula.empty() &&
+        (opt.importance == "de" || !opt.worker.empty() ||
+         !opt.coordinator.empty())) {
+        std::cerr << "--formula can't be combined with --importance de or a "
+                     "farm"
+                  << std::endl;
+        return 1;
+    }
+    if (opt.settings.julia &&
+        (opt.importance == "de" || !opt.formula.empty())) {
+        std::cerr << "--julia can't be combined with --importance de or "
+                     "--formula"
+                  << std::endl;
+        return 1;
+    }
+
+    // frames go to the stream in the order they are written
+    std::unique_ptr<frame_stream> frames;
+    if (!opt.raw.empty()) {
+        std::signal(SIGPIPE, SIG_IGN);
+        frames = std::make_unique<frame_stream>(opt.raw, opt.raw_format,
+                                                opt.image_size);
+        if (!*frames) {
+            std::cerr << "could not open " << opt.raw << std::endl;
+            return 1;
+        }
+        opt.output.frames = frames.get();
+    }
+
+    const int status = opt.importance == "de"
+                           ? run<distance_estimator_importance>(opt)
+                           : run<path_length_importance>(opt);
+    if (frames && !frames->close()) {
+        std::cerr << "could not write all frames" << std::endl;
+        return 1;
+    }
+    return status;
+}
@@ -0,0 +1,1165 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace buddha {
+
+using idx = std::ptrdiff_t;
+using pt = std::complex<double>;  // a point in real life
+using px = std::pair<idx, idx>;   // pixel in the image
+
+/**
+ * struct to represent a bounding box
+ */
+struct bounds {
+    double ulo, uhi, vlo, vhi;
+};
+
+/**
+ * Formula policy: the classic Mandelbrot recurrence z -> z^2 + c.
+ *
+ * A batched formula instead provides operator()(z, c, next, n), computing
+ * next[k] from z[k] and c[k] for n orbits at once. If cull_exterior is set,
+ * the formula satisfies the escape bound used by escapes_before().
+ */
+struct mandelbrot_formula {
+    static constexpr bool batched = false;
+    static constexpr bool cull_exterior = true;
+
+    pt operator()(const pt z, const pt c) const { return z * z + c; }
+
+    /**
+     * whether the image is symmetric about the real axis
+     */
+    bool conjugate_symmetric() const { return true; }
+
+    /**
+     * derivative of the next z with respect to c, given z and dz/dc
+     */
+    pt derivative(const pt z, const pt dz) const { return 2.0 * z * dz + 1.0; }
+};
+
+/**
+ * Sampler policy: uniformly random points within a cell.
+ */
+class uniform_sampler {
+   private:
+    std::mt19937 engine;
+
+   public:
+    explicit uniform_sampler(const idx seed) : engine(seed) {}
+
+    /**
+     * sample a random point within bounding box
+     */
+    pt operator()(const bounds& bb) {
+        std::uniform_real_distribution<double> uniform_dist_real(bb.ulo,
+                                                                 bb.uhi);
+        std::uniform_real_distribution<double> uniform_dist_imag(bb.vlo,
+                                                                 bb.vhi);
+        return pt(uniform_dist_real(engine), uniform_dist_imag(engine));
+    }
+
+    /**
+     * a uniformly random number in [0, 1)
+     */
+    double uniform() {
+        return std::uniform_real_distribution<double>(0, 1)(engine);
+    }
+};
+
+/**
+ * Accumulator policy: owns a zero-initialized row-major image.
+ *
+ * If an accumulator sets needs_escape_time, the renderer calls
+ * begin_orbit(escape_time) before splatting each orbit.
+ */
+class vector_accumulator {
+   private:
+    idx image_size;
+    std::vector<double> image;
+
+   public:
+    static constexpr bool needs_escape_time = false;
+
+    explicit vector_accumulator(const idx image_size_)
+        : image_size(image_size_), image(image_size * image_size, 0) {}
+
+    void add(const idx u, const idx v, const double w) {
+        image[u * image_size + v] += w;
+    }
+    void prefetch(const idx u, const idx v) const {
+        __builtin_prefetch(&image[u * image_size + v], 1);
+    }
+    double operator()(const idx u, const idx v) const {
+        return image[u * image_size + v];
+    }
+    double* data() { return image.data(); }
+    const double* data() const { return image.data(); }
+    void clear() { std::fill(image.begin(), image.end(), 0.0); }
+};
+
+/**
+ * Accumulator policy: adds into a caller-owned row-major image of
+ * image_size * image_size doubles, without copying or clearing it.
+ * Each renderer running concurrently needs its own buffer.
+ */
+class buffer_accumulator {
+   private:
+    idx image_size;
+    double* image;
+
+   public:
+    static constexpr bool needs_escape_time = false;
+
+    buffer_accumulator(double* image_, const idx image_size_)
+        : image_size(image_size_), image(image_) {}
+
+    void add(const idx u, const idx v, const double w) {
+        image[u * image_size + v] += w;
+    }
+    void prefetch(const idx u, const idx v) const {
+        __builtin_prefetch(&image[u * image_size + v], 1);
+    }
+    double operator()(const idx u, const idx v) const {
+        return image[u * image_size + v];
+    }
+    double* data() { return image; }
+    const double* data() const { return image; }
+};
+
+/**
+ * Accumulator policy: keeps a separate image, or band, for each range of
+ * escape times, so that one render at the largest iteration limit also gives
+ * the image at every smaller limit.
+ *
+ * An orbit that escapes at escape time t (as in orbit_info) is splatted the
+ * same way whatever the limit, as long as t < limit. Given increasing limits,
+ * band k holds the orbits with limits[k - 1] <= t < limits[k], so the image
+ * at limits[k] is the sum of bands 0 to k.
+ */
+class band_accumulator {
+   private:
+    idx image_size;
+    std::vector<idx> limits;
+    std::vector<double> bands;
+    double* current;
+
+   public:
+    static constexpr bool needs_escape_time = true;
+
+    band_accumulator(const idx image_size_, std::vector<idx> limits_)
+        : image_size(image_size_),
+          limits(std::move(limits_)),
+          bands(limits.size() * image_size * image_size, 0),
+          current(bands.data()) {}
+
+    void begin_orbit(const idx escape_time) {
+        const idx k = std::upper_bound(limits.begin(), limits.end(),
+                                       escape_time) -
+                      limits.begin();
+        current = band(std::min<idx>(k, limits.size() - 1));
+    }
+
+    void add(const idx u, const idx v, const double w) {
+        current[u * image_size + v] += w;
+    }
+    void prefetch(const idx u, const idx v) const {
+        __builtin_prefetch(current + u * image_size + v, 1);
+    }
+
+    /**
+     * the image at the largest limit, which is the sum of all bands
+     */
+    double operator()(const idx u, const idx v) const {
+        double x = 0;
+        for (std::size_t k = 0; k < limits.size(); k++) {
+            x += band(k)[u * image_size + v];
+        }
+        return x;
+    }
+    idx n_bands() const { return limits.size(); }
+    double* band(const idx k) {
+        return bands.data() + k * image_size * image_size;
+    }
+    const double* band(const idx k) const {
+        return bands.data() + k * image_size * image_size;
+    }
+};
+
+/**
+ * Scheduler policy: visits every stride-th row of cells starting at offset,
+ * so that several renderers with the same stride and different offsets
+ * cover the image exactly once between them.
+ */
+struct strided_scheduler {
+    idx stride = 1;
+    idx offset = 0;
+
+    template <typename F>
+    void operator()(const idx image_size, F render_cell) const {
+        for (idx u = offset; u < image_size; u += stride) {
+            for (idx v = 0; v < image_size; v++) {
+                render_cell(u, v);
+            }
+        }
+    }
+};
+
+/**
+ * Scheduler policy: renders the ranges of rows [u0, u1) handed out by next
+ * until it returns false. This lets a coordinator balance rows dynamically
+ * between renderers of different speeds.
+ */
+struct pull_scheduler {
+    std::function<bool(idx&, idx&)> next;
+
+    template <typename F>
+    void operator()(const idx image_size, F render_cell) const {
+        idx u0, u1;
+        while (next(u0, u1)) {
+            for (idx u = std::max<idx>(0, u0); u < std::min(u1, image_size);
+                 u++) {
+                for (idx v = 0; v < image_size; v++) {
+                    render_cell(u, v);
+                }
+            }
+        }
+    }
+};
+
+/**
+ * what a sampled orbit tells an importance policy about its cell
+ */
+struct orbit_info {
+    idx escaped_time;  // 0 if the orbit did not escape
+    double distance;   // exterior distance estimate, if escaped and requested
+    bool escaped;      // escaped_time is also 0 if it escaped immediately
+};
+
+/**
+ * optional settings for a renderer
+ */
+struct render_settings {
+    // splat orbit points with a tent filter instead of into the nearest pixel
+    bool bilinear = false;
+
+    // Russian roulette: a cell whose first pilot escapes within
+    // roulette_max_path iterations is only rendered with this probability,
+    // and its weight is scaled up to compensate. 1 disables it.
+    double roulette = 1;
+    idx roulette_max_path = 2;
+
+    // orbits with a shorter escape time than this are not splatted
+    idx min_iterations = 0;
+
+    // Julia mode: the cells are starting points z0 for the fixed julia_c,
+    // instead of values of c with z0 = 0. Since z^2 + c is even in z, the
+    // orbits from z0 and -z0 splat the same points from z1 on, so only the
+    // left half is sampled, with double weight.
+    bool julia = false;
+    pt julia_c = 0;
+
+    // ask for transparent huge pages for the trajectory arena
+    bool huge_pages = false;
+};
+
+/**
+ * Importance policy: the importance of a cell grows with the longest path
+ * seen so far, as 5 + 2 * max_path^2 samples, and a cell where an orbit fails
+ * to escape after one escaped is on the edge of the Mandelbrot set and gets
+ * max_samples.
+ *
+ * An importance policy is told about each orbit in turn through update(),
+ * and returns the number of samples the cell should now get in total.
+ * begin() resets it for a new cell and returns the number of pilot samples.
+ * If needs_distance is set, the renderer also tracks dz/dc alongside z to
+ * provide an exterior distance estimate for each escaped orbit.
+ */
+struct path_length_importance {
+    static constexpr bool needs_distance = false;
+    idx max_path = -1;
+
+    idx begin(const bounds&) {
+        max_path = -1;
+        return 5;
+    }
+
+    idx update(const orbit_info& orbit, idx samples, const idx max_samples) {
+        // the longer the path, the higher the importance.
+        if (orbit.escaped_time > max_path) {
+            max_path = orbit.escaped_time;
+            samples = std::max(
+                samples, std::min(max_samples, 5 + 2 * max_path * max_path));
+        }
+
+        // if we encounter the edge of the mandelbrot set, we treat this as
+        // the maximum importance.
+        if ((orbit.escaped_time == 0 && max_path > 0) ||
+            (orbit.escaped_time != 0 && max_path == -1)) {
+            samples = max_samples;
+        }
+        return samples;
+    }
+};
+
+/**
+ * Importance policy based on the exterior distance estimator.
+ *
+ * An escaped orbit's distance estimate d says how far its c is from the
+ * Mandelbrot set. Orbits that contribute a lot come from close to the
+ * boundary, so a cell of size h gets a share 0.3 * sqrt(h / d) of
+ * max_samples (the share is capped once the boundary is within a cell).
+ * A cell far from the boundary, which is most of the exterior, stops after 2
+ * pilots instead of 5. Cells whose pilots don't escape keep 5 pilots to look
+ * for an edge, and cells with both kinds of orbit get max_samples.
+ */
+struct distance_estimator_importance {
+    static constexpr bool needs_distance = true;
+    bool seen_escaped = false;
+    bool seen_interior = false;
+    double cell_size = 0;
+
+    idx begin(const bounds& bb) {
+        seen_escaped = seen_interior = false;
+        cell_size = std::max(bb.uhi - bb.ulo, bb.vhi - bb.vlo);
+        return 2;
+    }
+
+    idx update(const orbit_info& orbit, const idx samples,
+               const idx max_samples) {
+        (orbit.escaped_time == 0 ? seen_interior : seen_escaped) = true;
+        if (seen_interior && seen_escaped) {
+            return max_samples;
+        }
+        if (orbit.escaped_time == 0) {
+            return std::max<idx>(samples, 5);
+        }
+        const double closeness =
+            orbit.distance > cell_size ? cell_size / orbit.distance : 1.0;
+        const double share = 0.3 * std::sqrt(closeness);
+        return std::max(samples,
+                        std::min(max_samples,
+                                 2 + static_cast<idx>(max_samples * share)));
+    }
+};
+
+/**
+ * Storage for the orbits of one cell, in one contiguous block with room for
+ * max_samples orbits of up to iterations points each.
+ *
+ * The block is reserved as address space without committing any memory, so
+ * creating a renderer is instant however large its parameters, and pages
+ * are only backed by memory once they are first written. Orbits are
+ * computed in scratch space past the end of the kept ones, and only orbits
+ * that will be splatted are kept, packed end to end. So the memory in use
+ * grows to the most that any one cell has needed to keep, rather than the
+ * worst case, since orbits that never escape take no room. If the
+ * reservation fails, everything is allocated up front instead.
+ */
+class trajectory_arena {
+   private:
+    idx stride;
+    idx used = 0;
+    pt* points = nullptr;
+    std::size_t length = 0;  // of the mapping, or 0 for the fallback
+    std::vector<pt> fallback;
+
+   public:
+    trajectory_arena(const idx max_samples, const idx iterations,
+                     const bool huge_pages)
+        : stride(iterations) {
+        const std::size_t n = max_samples * iterations;
+        void* p = ::mmap(nullptr, n * sizeof(pt), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            fallback.resize(n);
+            points = fallback.data();
+            return;
+        }
+        length = n * sizeof(pt);
+        if (huge_pages) {
+            ::madvise(p, length, MADV_HUGEPAGE);
+        }
+        points = static_cast<pt*>(p);
+    }
+
+    ~trajectory_arena() {
+        if (length > 0) ::munmap(points, length);
+    }
+
+    trajectory_arena(const trajectory_arena&) = delete;
+    trajectory_arena& operator=(const trajectory_arena&) = delete;
+
+    /**
+     * forget the kept orbits, for a new cell
+     */
+    void clear() { used = 0; }
+
+    /**
+     * room for the k-th of a batch of orbits being computed. It stays valid
+     * until the next call to keep() for an earlier orbit of the batch.
+     */
+    pt* scratch(const idx k) { return points + used + k * stride; }
+
+    /**
+     * keep the first n points of an orbit computed in scratch(), in order,
+     * and return where it is kept
+     */
+    idx keep(const pt* orbit, const idx n) {
+        if (orbit != points + used) {
+            std::memmove(points + used, orbit, n * sizeof(pt));
+        }
+        used += n;
+        return used - n;
+    }
+
+    const pt* operator[](const idx offset) const { return points + offset; }
+};
+
+template <typename Formula = mandelbrot_formula,
+          typename Sampler = uniform_sampler,
+          typename Accumulator = vector_accumulator,
+          typename Scheduler = strided_scheduler,
+          typename Importance = path_length_importance>
+class buddhabrot {
+   private:
+    static constexpr double escape_radius2 = 8.0;
+    // orbits iterated together, and how many points ahead to prefetch splats
+    static constexpr idx lanes = 8;
+    static constexpr idx prefetch_distance = 8;
+    const idx image_size;
+    const idx iterations;
+    const idx max_samples;
+    const render_settings settings;
+    Sampler sampler;
+    Accumulator image;
+    Scheduler scheduler;
+    Formula formula;
+    Importance importance;
+    trajectory_arena buf;
+    std::vector<idx> buflen;
+    std::vector<idx> bufstart;
+    std::vector<pt> bufc;
+    std::vector<char> bufescaped;
+    std::function<void(pt, double, const pt*, idx)> on_orbit;
+    std::atomic<idx> cells{0};
+    std::atomic<idx> orbits{0};
+
+    /**
+     * convert point to pixel
+     */
+    px to_px(const pt z) {
+        return std::make_pair(
+            static_cast<idx>(image_size * (z.real() + 2) / 4),
+            static_cast<idx>(image_size * (z.imag() + 2) / 4));
+    }
+
+    /**
+     * convert point to continuous pixel coordinates, with pixel centers at
+     * integer positions
+     */
+    std::pair<double, double> to_px_frac(const pt z) {
+        return std::make_pair(image_size * (z.real() + 2) / 4 - 0.5,
+                              image_size * (z.imag() + 2) / 4 - 0.5);
+    }
+
+    /**
+     * add weight to the image using a tent filter, spread over the 4 pixels
+     * nearest to z in proportion to their overlap
+     */
+    void splat_bilinear(const pt z, const double weight) {
+        const auto [x, y] = to_px_frac(z);
+        const double fu = std::floor(x);
+        const double fv = std::floor(y);
+        const idx u = static_cast<idx>(fu);
+        const idx v = static_cast<idx>(fv);
+        const double du = x - fu;
+        const double dv = y - fv;
+        const double w[4] = {(1 - du) * (1 - dv) * weight, (1 - du) * dv * weight,
+                             du * (1 - dv) * weight, du * dv * weight};
+        if (u >= 0 && v >= 0 && u + 1 < image_size && v + 1 < image_size) {
+            image.add(u, v, w[0]);
+            image.add(u, v + 1, w[1]);
+            image.add(u + 1, v, w[2]);
+            image.add(u + 1, v + 1, w[3]);
+            return;
+        }
+        for (idx k = 0; k < 4; k++) {
+            const px p = std::make_pair(u + k / 2, v + k % 2);
+            if (in_bounds(p)) image.add(p.first, p.second, w[k]);
+        }
+    }
+
+    /**
+     * add weight to the image at z
+     */
+    void splat(const pt z, const double weight) {
+        if (settings.bilinear) {
+            splat_bilinear(z, weight);
+            return;
+        }
+        const px y = to_px(z);
+        if (in_bounds(y)) image.add(y.first, y.second, weight);
+    }
+
+    /**
+     * convert pixel to point
+     */
+    pt to_pt(const px x) {
+        return pt(x.first * 4.0 / image_size - 2.0,
+                  x.second * 4.0 / image_size - 2.0);
+    }
+
+    /**
+     * check if a pixel is within bounds of the image
+     */
+    bool in_bounds(px y) {
+        return y.first >= 0 && y.second >= 0 && y.first < image_size &&
+               y.second < image_size;
+    }
+
+    /**
+     * Whether every orbit in the cell provably escapes with an escape time
+     * below k. For |c| > 2, |z_1| = |c| and |z_{n+1}| >= |z_n|^2 - |c| give
+     * |z_n| >= |c| (|c| - 1)^(n - 1) by induction, so it is enough to check
+     * the point of the cell closest to the origin.
+     */
+    bool escapes_before(const bounds& bb, const idx k) const {
+        const double u = std::clamp(0.0, bb.ulo, bb.uhi);
+        const double v = std::clamp(0.0, bb.vlo, bb.vhi);
+        const double m = std::sqrt(u * u + v * v);
+        if (m <= 2) return false;
+        // lower bound on |z_n|, which escapes at escape time n - 1
+        double r = m;
+        for (idx n = 1; n < k && r * r <= escape_radius2; n++) {
+            r *= m - 1;
+        }
+        return r * r > escape_radius2;
+    }
+
+    /**
+     * Sample n <= lanes orbits in the cell and iterate them together, storing
+     * orbit k in points[k] and its c in bufc[first + k]. A single orbit is one
+     * long chain of dependent floating point operations, so advancing a few
+     * independent ones round-robin keeps the pipeline busy.
+     */
+    void iterate_orbits(const bounds& bb, const idx first, const idx n,
+                        orbit_info* orbit, pt* const* points) {
+        pt c[lanes], z[lanes], dz[lanes];
+        bool active[lanes];
+        for (idx k = 0; k < n; k++) {
+            // bufc holds the sampled point, c or z0 in Julia mode
+            const pt sample = bufc[first + k] = sampler(bb);
+            c[k] = settings.julia ? settings.julia_c : sample;
+            z[k] = settings.julia ? sample : pt(0, 0);
+            dz[k] = pt(0, 0);
+            orbit[k] = orbit_info{0, 0, false};
+            active[k] = true;
+        }
+        idx n_active = n;
+        for (idx i = 0; i < iterations && n_active > 0; i++) {
+            pt next[lanes];
+            if constexpr (Formula::batched) {
+                formula(z, c, next, n);
+            }
+            for (idx k = 0; k < n; k++) {
+                if (!active[k]) continue;
+                if constexpr (Importance::needs_distance) {
+                    dz[k] = formula.derivative(z[k], dz[k]);
+                }
+                if constexpr (Formula::batched) {
+                    z[k] = next[k];
+                } else {
+                    z[k] = formula(z[k], c[k]);
+                }
+                points[k][i] = z[k];
+                if (z[k].imag() * z[k].imag() + z[k].real() * z[k].real() >
+                    escape_radius2) {
+                    orbit[k].escaped_time = i;
+                    orbit[k].escaped = true;
+                    active[k] = false;
+                    n_active--;
+                }
+            }
+        }
+        if constexpr (Importance::needs_distance) {
+            for (idx k = 0; k < n; k++) {
+                if (orbit[k].escaped_time != 0) {
+                    const double r = std::abs(z[k]);
+                    orbit[k].distance = r * std::log(r) / std::abs(dz[k]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Render a region within bounding box
+     *
+     * This is an adaptive sampling algorithm that uses importance sampling.
+     * The importance policy looks at each orbit as it is sampled and decides
+     * how many samples the region deserves in total; see
+     * path_length_importance for the default heuristic.
+     *
+     * For example, for points in the Mandelbrot set, after 5 samples, it will
+     * immediately terminate. However, interesting points tend to be on the
+     * edges of the set. So, cells that contain points both in and out of the
+     * Mandelbrot set will be considered to have maximum importance.
+     *
+     * Most of the exterior escapes within a couple of iterations and adds an
+     * almost uniform haze. With Russian roulette enabled, such a cell, as
+     * judged by its first pilot, is dropped with probability 1 - roulette,
+     * and otherwise rendered as usual with its weight scaled by 1 / roulette,
+     * so the expected image is unchanged but most of its pilots are saved.
+     *
+     * With settings.min_iterations, orbits that escape sooner are dropped,
+     * and cells where escapes_before() shows that every orbit would be
+     * dropped are skipped without sampling.
+     *
+     * Each orbit is splatted with weight cell_weight / samples.
+     * Returns the number of orbits sampled.
+     */
+    idx render_region(const bounds& bb, double cell_weight = 1.0) {
+        if constexpr (Formula::cull_exterior) {
+            if (!settings.julia &&
+                escapes_before(bb, std::max<idx>(1, settings.min_iterations))) {
+                return 0;
+            }
+        }
+        idx samples = importance.begin(bb);
+        buf.clear();
+        for (idx trial = 0; trial < samples;) {
+            // the first pilot runs alone if roulette may drop the cell
+            const idx n = std::min<idx>(
+                trial == 0 && settings.roulette < 1 ? 1 : lanes,
+                samples - trial);
+            orbit_info orbit[lanes];
+            pt* points[lanes];
+            for (idx k = 0; k < n; k++) {
+                points[k] = buf.scratch(k);
+            }
+            iterate_orbits(bb, trial, n, orbit, points);
+            for (idx k = 0; k < n; k++, trial++) {
+                orbit_info seen = orbit[k];
+                const bool too_short =
+                    seen.escaped && seen.escaped_time < settings.min_iterations;
+                if (too_short) {
+                    // to the importance policy, an orbit too short to splat
+                    // only says that the cell is outside the set
+                    seen.escaped_time = std::min<idx>(seen.escaped_time, 1);
+                }
+                samples = importance.update(seen, samples, max_samples);
+                buflen[trial] = too_short ? 0 : orbit[k].escaped_time;
+                bufescaped[trial] = orbit[k].escaped && !too_short;
+                bufstart[trial] = buf.keep(points[k], buflen[trial]);
+            }
+
+            if (trial == 1 && settings.roulette < 1 && orbit[0].escaped &&
+                orbit[0].escaped_time <= settings.roulette_max_path) {
+                if (sampler.uniform() >= settings.roulette) {
+                    return 1;
+                }
+                cell_weight /= settings.roulette;
+            }
+        }
+
+        const double weight = cell_weight / samples;
+        for (idx trial = 0; trial < samples; trial++) {
+            if constexpr (Accumulator::needs_escape_time) {
+                image.begin_orbit(buflen[trial]);
+            }
+            const pt* orbit = buf[bufstart[trial]];
+            const idx len = buflen[trial];
+            if (on_orbit && bufescaped[trial]) {
+                on_orbit(bufc[trial], weight, orbit, len);
+            }
+            // prefetch the pixels a few points ahead, since the image is
+            // usually far bigger than the cache
+            for (idx i = 0; i < len; i++) {
+                if (i + prefetch_distance < len) {
+                    const px ahead = to_px(orbit[i + prefetch_distance]);
+                    if (in_bounds(ahead)) {
+                        image.prefetch(ahead.first, ahead.second);
+                    }
+                }
+                splat(orbit[i], weight);
+            }
+        }
+        return samples;
+    }
+
+   public:
+    buddhabrot(const idx image_size_, const idx iterations_,
+               const idx max_samples_, Sampler sampler_,
+               Accumulator accumulator_, Scheduler scheduler_ = Scheduler(),
+               const render_settings settings_ = render_settings(),
+               Formula formula_ = Formula(),
+               Importance importance_ = Importance())
+        : image_size(image_size_),
+          iterations(iterations_),
+          max_samples(max_samples_),
+          settings(settings_),
+          sampler(std::move(sampler_)),
+          image(std::move(accumulator_)),
+          scheduler(std::move(scheduler_)),
+          formula(std::move(formula_)),
+          importance(std::move(importance_)),
+          buf(max_samples, iterations, settings.huge_pages),
+          buflen(max_samples),
+          bufstart(max_samples),
+          bufc(max_samples),
+          bufescaped(max_samples) {}
+
+    /**
+     * render one cell of the grid, u being the row along the real axis
+     */
+    void render_cell(const idx u, const idx v) {
+        pt a = to_pt(std::make_pair(u, v));
+        pt b = to_pt(std::make_pair(u + 1, v + 1));
+        // in Julia mode, each cell of the left half stands in for its mirror
+        // image through the origin too, except for a middle row, which is
+        // its own mirror image
+        const idx sampled =
+            settings.julia && 2 * u + 1 > image_size
+                ? 0
+                : render_region(bounds{a.real(), b.real(), a.imag(), b.imag()},
+                                settings.julia && 2 * u + 1 < image_size
+                                    ? 2.0
+                                    : 1.0);
+        // only the rendering thread writes these, so no read-modify-write
+        orbits.store(orbits.load(std::memory_order_relaxed) + sampled,
+                     std::memory_order_relaxed);
+        cells.store(cells.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+
+    void render() {
+        scheduler(image_size, [this](idx u, idx v) { render_cell(u, v); });
+    }
+
+    /**
+     * Call f(c, weight, points, n) for every escaping orbit as it is splatted,
+     * where points are the n orbit points splatted with the given weight.
+     */
+    void set_orbit_callback(std::function<void(pt, double, const pt*, idx)> f) {
+        on_orbit = std::move(f);
+    }
+
+    /**
+     * progress counters, safe to read while rendering
+     */
+    idx cells_rendered() const { return cells.load(std::memory_order_relaxed); }
+    idx orbits_sampled() const {
+        return orbits.load(std::memory_order_relaxed);
+    }
+
+    double operator()(idx u, idx v) const { return image(u, v); }
+    Accumulator& accumulator() { return image; }
+    const Accumulator& accumulator() const { return image; }
+};
+
+/**
+ * run fn(i) for every i in [0, n) on n_threads threads.
+ * Items are handed out dynamically, so uneven items still balance well.
+ */
+template <typename F>
+void parallel_for(const idx n_threads, const idx n, F fn) {
+    std::atomic<idx> next(0);
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads);
+    for (idx t = 0; t < n_threads; t++) {
+        threads.emplace_back([&]() {
+            for (idx i = next++; i < n; i = next++) {
+                fn(i);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+/**
+ * the range of an unfolded merged image, used to normalize it
+ */
+struct value_range {
+    double min_val, max_val;
+};
+
+/**
+ * Merge the images of all the renderers into merged (row-major), folding the
+ * image about the real axis since the buddhabrot is symmetric under complex
+ * conjugation, unless fold is false. Returns the range of the merged image
+ * before folding.
+ */
+template <typename Brot>
+value_range merge(const std::vector<std::unique_ptr<Brot>>& brots,
+                  const idx image_size, const idx n_threads,
+                  std::vector<double>& merged, const bool fold = true) {
+    merged.resize(image_size * image_size);
+    std::vector<double> row_min(image_size,
+                                std::numeric_limits<double>::infinity());
+    std::vector<double> row_max(image_size, 0);
+    parallel_for(n_threads, image_size, [&](idx u) {
+        for (idx v = 0; v < image_size; v++) {
+            double x = 0;
+            for (auto& b : brots) {
+                x += (*b)(u, v);
+            }
+            row_min[u] = std::min(row_min[u], x);
+            row_max[u] = std::max(row_max[u], x);
+            if (!fold) {
+                merged[u * image_size + v] = x;
+                continue;
+            }
+            for (auto& b : brots) {
+                x += (*b)(u, image_size - 1 - v);
+            }
+            merged[u * image_size + v] = x * 0.5;
+        }
+    });
+    return value_range{*std::min_element(row_min.begin(), row_min.end()),
+                       *std::max_element(row_max.begin(), row_max.end())};
+}
+
+/**
+ * Header of a saved accumulator file. It is followed by image_size *
+ * image_size doubles in row-major order: the linear, unfolded image averaged
+ * over the number of full passes over the grid that went into it.
+ *
+ * Besides the sampling parameters, it records the settings that change the
+ * image being estimated, so that passes are only ever combined with passes
+ * of the same image. The formula is recorded as a hash of its text, 0 for
+ * the built-in z^2 + c. fold says whether the image should be folded about
+ * the real axis when it is displayed.
+ */
+struct accumulator_header {
+    char magic[8];
+    std::int64_t image_size;
+    std::int64_t iterations;
+    std::int64_t max_samples;
+    std::int64_t passes;
+    std::int64_t min_iterations;
+    std::int64_t bilinear;
+    std::int64_t julia;
+    double julia_re;
+    double julia_im;
+    std::uint64_t formula;
+    std::int64_t fold;
+};
+
+constexpr char accumulator_magic[8] = {'B', 'U', 'D', 'D', 'H', 'A', '0', '2'};
+
+/**
+ * 64-bit FNV-1a hash of a formula's text, or 0 for no formula
+ */
+inline std::uint64_t formula_hash(const std::string& formula) {
+    if (formula.empty()) return 0;
+    std::uint64_t h = 14695981039346656037ull;
+    for (const unsigned char ch : formula) {
+        h = (h ^ ch) * 1099511628211ull;
+    }
+    return h;
+}
+
+inline accumulator_header make_accumulator_header(
+    const idx image_size, const idx iterations, const idx max_samples,
+    const render_settings& settings, const std::string& formula,
+    const bool fold, const idx passes) {
+    accumulator_header header{{},
+                              image_size,
+                              iterations,
+                              max_samples,
+                              passes,
+                              settings.min_iterations,
+                              settings.bilinear,
+                              settings.julia,
+                              settings.julia ? settings.julia_c.real() : 0,
+                              settings.julia ? settings.julia_c.imag() : 0,
+                              formula_hash(formula),
+                              fold};
+    std::memcpy(header.magic, accumulator_magic, sizeof(header.magic));
+    return header;
+}
+
+/**
+ * whether two accumulators were rendered with the same settings, apart from
+ * their number of passes and folding, so that their passes can be combined
+ */
+inline bool same_render(const accumulator_header& a,
+                        const accumulator_header& b) {
+    return a.image_size == b.image_size && a.iterations == b.iterations &&
+           a.max_samples == b.max_samples &&
+           a.min_iterations == b.min_iterations && a.bilinear == b.bilinear &&
+           a.julia == b.julia && a.julia_re == b.julia_re &&
+           a.julia_im == b.julia_im && a.formula == b.formula;
+}
+
+inline bool save_accumulator(const std::string& filename,
+                             const accumulator_header& header,
+                             const double* image) {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(image),
+              header.image_size * header.image_size * sizeof(double));
+    return static_cast<bool>(out);
+}
+
+inline bool load_accumulator(const std::string& filename,
+                             accumulator_header& header,
+                             std::vector<double>& image) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, accumulator_magic, sizeof(header.magic)) !=
+            0 ||
+        header.image_size <= 0 || header.passes <= 0) {
+        return false;
+    }
+    image.resize(header.image_size * header.image_size);
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(image.data()),
+                                     image.size() * sizeof(double)));
+}
+
+/**
+ * Combine new_passes full passes, rendered by brots, with a prior image
+ * averaged over prior_passes (which may be 0, with prior null), into total:
+ * the per-pass average over all of them. Since every pass is an independent
+ * unbiased estimate of the density, this is the correct weighting for adding
+ * passes to an existing render.
+ */
+template <typename Brot>
+void combine_passes(const std::vector<std::unique_ptr<Brot>>& brots,
+                    const idx image_size, const idx n_threads,
+                    const double* prior, const idx prior_passes,
+                    const idx new_passes, double* total) {
+    const double scale = 1.0 / (prior_passes + new_passes);
+    parallel_for(n_threads, image_size, [&](idx u) {
+        for (idx v = 0; v < image_size; v++) {
+            double x = prior ? prior[u * image_size + v] * prior_passes : 0;
+            for (auto& b : brots) {
+                x += (*b)(u, v);
+            }
+            total[u * image_size + v] = x * scale;
+        }
+    });
+}
+
+/**
+ * Area-average a merged image down by each of the given factors in a single
+ * parallel sweep over it. The result for factor f is (image_size / f)^2
+ * pixels, and any rows and columns left over at the edge are dropped.
+ *
+ * The sweep goes over bands of rows whose height is a multiple of every
+ * factor, so that each band fills whole rows of every output and the bands
+ * can be processed independently.
+ */
+inline std::vector<std::vector<double>> downsample(
+    const std::vector<double>& image, const idx image_size,
+    const idx n_threads, const std::vector<idx>& factors) {
+    std::vector<std::vector<double>> outputs;
+    idx band = 1;
+    for (const idx f : factors) {
+        outputs.emplace_back((image_size / f) * (image_size / f), 0.0);
+        band = std::lcm(band, f);
+    }
+    parallel_for(n_threads, (image_size + band - 1) / band, [&](idx b) {
+        for (std::size_t k = 0; k < factors.size(); k++) {
+            const idx f = factors[k];
+            const idx size = image_size / f;
+            const double scale = 1.0 / (f * f);
+            for (idx su = b * band / f; su < std::min(size, (b + 1) * band / f);
+                 su++) {
+                double* out = outputs[k].data() + su * size;
+                for (idx u = su * f; u < (su + 1) * f; u++) {
+                    const double* row = image.data() + u * image_size;
+                    for (idx sv = 0; sv < size; sv++) {
+                        double x = 0;
+                        for (idx v = sv * f; v < (sv + 1) * f; v++) {
+                            x += row[v];
+                        }
+                        out[sv] += x * scale;
+                    }
+                }
+            }
+        }
+    });
+    return outputs;
+}
+
+/**
+ * brightness-normalize and gamma-correct a merged value into [0, 1]
+ */
+inline double tone_map(const double x, const value_range& range) {
+    return std::sqrt(std::clamp(
+        (x - range.min_val) / (range.max_val - range.min_val), 0.0, 1.0));
+}
+
+/**
+ * Edge-preserving denoise of a merged accumulator, in place.
+ *
+ * At low sample counts, the density in dim regions is dominated by shot
+ * noise. Its variance grows with the density, so we work on sqrt(x), where
+ * the noise is roughly uniform across the image and can be estimated once
+ * from the median absolute difference between neighbouring pixels.
+ *
+ * Each pixel is then replaced by a bilateral average over a 5x5 window, with
+ * the range kernel scaled to the noise level times strength. Finally the
+ * filtered value is blended with the original according to how much of the
+ * local variance is explained by noise: flat grainy regions are smoothed
+ * fully, while real structure (whose variance is well above the noise) is
+ * mostly kept.
+ *
+ * The image is processed in independent 64x64 tiles in parallel.
+ */
+inline void denoise(std::vector<double>& image, const idx image_size,
+                    const idx n_threads, const double strength) {
+    constexpr idx radius = 2;
+    constexpr idx tile = 64;
+    constexpr double sigma_spatial = 1.5;
+
+    for (auto& x : image) {
+        x = std::sqrt(std::max(0.0, x));
+    }
+
+    // robust noise estimate from a subset of horizontal neighbour differences
+    std::vector<double> diffs;
+    const idx step = std::max<idx>(1, image_size / 512);
+    for (idx u = 0; u < image_size; u += step) {
+        for (idx v = 0; v + 1 < image_size; v += step) {
+            const double a = image[u * image_size + v];
+            const double b = image[u * image_size + v + 1];
+            if (a > 0 || b > 0) {
+                diffs.push_back(std::abs(a - b));
+            }
+        }
+    }
+    double sigma_noise = 0;
+    if (!diffs.empty()) {
+        std::nth_element(diffs.begin(), diffs.begin() + diffs.size() / 2,
+                         diffs.end());
+        // for gaussian noise, median(|a - b|) = 0.6745 * sqrt(2) * sigma
+        sigma_noise = diffs[diffs.size() / 2] / (0.6745 * std::sqrt(2));
+    }
+    if (sigma_noise <= 0) {
+        // nothing to denoise, so just undo the sqrt
+        for (auto& x : image) {
+            x *= x;
+        }
+        return;
+    }
+    const double noise_var = sigma_noise * sigma_noise;
+    const double range_scale =
+        -0.5 / (strength * strength * sigma_noise * sigma_noise);
+
+    double spatial[2 * radius + 1][2 * radius + 1];
+    for (idx du = -radius; du <= radius; du++) {
+        for (idx dv = -radius; dv <= radius; dv++) {
+            spatial[du + radius][dv + radius] = std::exp(
+                -0.5 * (du * du + dv * dv) / (sigma_spatial * sigma_spatial));
+        }
+    }
+
+    std::vector<double> filtered(image.size());
+    const idx tiles_per_side = (image_size + tile - 1) / tile;
+    parallel_for(n_threads, tiles_per_side * tiles_per_side, [&](idx t) {
+        const idx u0 = (t / tiles_per_side) * tile;
+        const idx v0 = (t % tiles_per_side) * tile;
+        const idx u1 = std::min(image_size, u0 + tile);
+        const idx v1 = std::min(image_size, v0 + tile);
+        for (idx u = u0; u < u1; u++) {
+            for (idx v = v0; v < v1; v++) {
+                const double center = image[u * image_size + v];
+                double sum = 0, sum_w = 0, mean = 0, mean2 = 0;
+                idx count = 0;
+                for (idx du = -radius; du <= radius; du++) {
+                    const idx uu = u + du;
+                    if (uu < 0 || uu >= image_size) continue;
+                    for (idx dv = -radius; dv <= radius; dv++) {
+                        const idx vv = v + dv;
+                        if (vv < 0 || vv >= image_size) continue;
+                        const double x = image[uu * image_size + vv];
+                        const double d = x - center;
+                        const double w = spatial[du + radius][dv + radius] *
+                                         std::exp(d * d * range_scale);
+                        sum += w * x;
+                        sum_w += w;
+                        mean += x;
+                        mean2 += x * x;
+                        count++;
+                    }
+                }
+                mean /= count;
+                const double local_var =
+                    std::max(noise_var, mean2 / count - mean * mean);
+                const double k = std::min(1.0, strength * noise_var / local_var);
+                const double x = center + k * (sum / sum_w - center);
+                filtered[u * image_size + v] = x * x;
+            }
+        }
+    });
+    image.swap(filtered);
+}
+
+/**
+ * Estimate the noise of a render, for comparing settings by quality per
+ * CPU-second. Returns a negative value if there are fewer than 2 renderers.
+ *
+ * Strided renderers cover disjoint interleaved rows of cells, so the even and
+ * odd ones give two independent estimates of nearly the same image. Half the
+ * RMS difference between them, in the sqrt domain where shot noise is roughly
+ * uniform and relative to the brightest pixel, measures the remaining grain.
+ * Since Monte Carlo variance falls as 1 / samples, 1 / (noise^2 * cpu_seconds)
+ * is a figure of merit that stays roughly constant as the budget of a fixed
+ * sampling scheme grows. It measures variance only: filtering that blurs the
+ * image, such as bilinear splatting, also lowers it.
+ */
+template <typename Brot>
+double estimate_noise(const std::vector<std::unique_ptr<Brot>>& brots,
+                      const idx image_size) {
+    if (brots.size() < 2) {
+        return -1;
+    }
+    const idx n_even = (brots.size() + 1) / 2;
+    const idx n_odd = brots.size() / 2;
+    double sum2 = 0, max_val = 0;
+    idx count = 0;
+    for (idx u = 0; u < image_size; u++) {
+        for (idx v = 0; v < image_size; v++) {
+            double a = 0, b = 0;
+            for (size_t t = 0; t < brots.size(); t++) {
+                (t % 2 == 0 ? a : b) += (*brots[t])(u, v);
+            }
+            a /= n_even;
+            b /= n_odd;
+            max_val = std::max(max_val, std::max(a, b));
+            if (a > 0 || b > 0) {
+                const double d = std::sqrt(a) - std::sqrt(b);
+                sum2 += d * d;
+                count++;
+            }
+        }
+    }
+    if (count == 0 || max_val <= 0) {
+        return -1;
+    }
+    return 0.5 * std::sqrt(sum2 / count) / std::sqrt(max_val);
+}
+
+}  // namespace buddha
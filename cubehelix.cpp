@@ -1,7 +1,18 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cmath>
+#include <iostream>
+#include <mutex>
 #include <png++/png.hpp>
 #include <sstream>
 
+#include "buddhabrot.hpp"
+
+using namespace buddha;
+
 /**
  * Logistic function to increase contrast in image.
  */
@@ -22,21 +33,162 @@ double brighten(double x, double m = 2.0, double k = 15) {
     return x;
 }
 
+/**
+ * palette index for a tone mapped value x in [0, 1]
+ */
+png::index_pixel colourize(double x, double amount) {
+    return png::index_pixel(
+        std::min(255.0, 255.0 * std::sqrt(sigmoid(brighten(x), amount))));
+}
+
+/**
+ * A read-only memory mapping of an accumulator file saved by buddhabrot.
+ * The pixels are used in place, without copying or decoding.
+ */
+class mapped_accumulator {
+   private:
+    void* mapping = MAP_FAILED;
+    std::size_t length = 0;
+
+   public:
+    const accumulator_header* header = nullptr;
+    const double* image = nullptr;
+
+    explicit mapped_accumulator(const char* filename) {
+        const int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 &&
+            st.st_size >= static_cast<off_t>(sizeof(accumulator_header))) {
+            length = st.st_size;
+            mapping = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapping == MAP_FAILED) return;
+        auto h = static_cast<const accumulator_header*>(mapping);
+        if (std::memcmp(h->magic, accumulator_magic, sizeof(h->magic)) != 0 ||
+            h->image_size <= 0 ||
+            length < sizeof(accumulator_header) +
+                         h->image_size * h->image_size * sizeof(double)) {
+            return;
+        }
+        ::madvise(mapping, length, MADV_WILLNEED);
+        header = h;
+        image = reinterpret_cast<const double*>(h + 1);
+    }
+
+    ~mapped_accumulator() {
+        if (mapping != MAP_FAILED) ::munmap(mapping, length);
+    }
+
+    explicit operator bool() const { return header != nullptr; }
+};
+
+/**
+ * A downsampled copy of the output. Each of its pixels is the box filtered
+ * average of the input values that fall in it, taken before the palette
+ * lookup.
+ */
+struct thumbnail {
+    idx width, height;
+    std::vector<double> sum, count;
+    std::vector<std::mutex> row_locks;
+
+    thumbnail(idx size, idx input_width, idx input_height)
+        : width(input_width >= input_height
+                    ? size
+                    : std::max<idx>(1, size * input_width / input_height)),
+          height(input_height >= input_width
+                     ? size
+                     : std::max<idx>(1, size * input_height / input_width)),
+          sum(width * height, 0),
+          count(width * height, 0),
+          row_locks(height) {}
+};
+
+/**
+ * Colourize an image given by value(u, v) in [0, 1] into output, and into
+ * every thumbnail in the same pass. Rows are processed in parallel.
+ */
+template <typename Value>
+void colourize_rows(const idx width, const idx height, Value value,
+                    const double amount, png::image<png::index_pixel>& output,
+                    std::vector<std::unique_ptr<thumbnail>>& thumbs) {
+    const idx n_threads = std::max(1u, std::thread::hardware_concurrency());
+    parallel_for(n_threads, height, [&](idx u) {
+        std::vector<double> row(width);
+        for (idx v = 0; v < width; v++) {
+            row[v] = value(u, v);
+            output[u][v] = colourize(row[v], amount);
+        }
+        for (auto& t : thumbs) {
+            const idx tu = u * t->height / height;
+            std::lock_guard<std::mutex> lock(t->row_locks[tu]);
+            double* sum = t->sum.data() + tu * t->width;
+            double* count = t->count.data() + tu * t->width;
+            for (idx v = 0; v < width; v++) {
+                const idx tv = v * t->width / width;
+                sum[tv] += row[v];
+                count[tv] += 1;
+            }
+        }
+    });
+}
+
+/**
+ * Colourize a linear accumulator, applying the same folding (if the header
+ * asks for it), normalization and gamma correction as buddhabrot does for
+ * its PNG output, but in double precision, so dark regions don't suffer
+ * from 16-bit quantization.
+ * Rows are processed in parallel straight from the mapping.
+ */
+void colourize_accumulator(const mapped_accumulator& acc,
+                           png::image<png::index_pixel>& output,
+                           std::vector<std::unique_ptr<thumbnail>>& thumbs,
+                           const double amount) {
+    const idx image_size = acc.header->image_size;
+    const double* image = acc.image;
+    const bool fold = acc.header->fold;
+    const idx n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<double> row_min(image_size,
+                                std::numeric_limits<double>::infinity());
+    std::vector<double> row_max(image_size, 0);
+    parallel_for(n_threads, image_size, [&](idx u) {
+        const double* row = image + u * image_size;
+        for (idx v = 0; v < image_size; v++) {
+            row_min[u] = std::min(row_min[u], row[v]);
+            row_max[u] = std::max(row_max[u], row[v]);
+        }
+    });
+    const value_range range{*std::min_element(row_min.begin(), row_min.end()),
+                            *std::max_element(row_max.begin(), row_max.end())};
+
+    colourize_rows(
+        image_size, image_size,
+        [&](idx u, idx v) {
+            const double* row = image + u * image_size;
+            return tone_map(
+                fold ? 0.5 * (row[v] + row[image_size - 1 - v]) : row[v],
+                range);
+        },
+        amount, output, thumbs);
+}
+
 int main(int argc, char** argv) {
     if (argc < 2) {
-        std::cout << "usage: ./cubehelix my_picture.png amount" << std::endl;
+        std::cout << "usage: ./cubehelix my_picture.png amount [sizes...]\n"
+                  << "   or: ./cubehelix my_accumulator amount [sizes...]\n"
+                  << "where my_accumulator was saved by buddhabrot --save, "
+                     "and each size adds a thumbnail of that size"
+                  << std::endl;
         return 1;
     }
     double amount = 3.0;
-    if (argc == 3) {
+    if (argc >= 3) {
         amount = std::atof(argv[2]);
     }
 
-    png::image<png::gray_pixel_16> input(argv[1]);
-    std::stringstream filename_ss;
-    filename_ss << "cubehelix_" << argv[1];
-    png::image<png::index_pixel> output(input.get_width(), input.get_height());
-
     png::palette pal(256);
 
     // generate CubeHelix palette from http://www.mrao.cam.ac.uk/~dag/CUBEHELIX/
@@ -61,16 +213,59 @@ int main(int argc, char** argv) {
         pal[i] = png::color(r * 255, g * 255, b * 255);
     }
 
-    output.set_palette(pal);
+    std::string name = argv[1];
+    const mapped_accumulator acc(argv[1]);
+    if (acc) {
+        name += ".png";
+    }
+    std::unique_ptr<png::image<png::gray_pixel_16>> input;
+    idx width, height;
+    if (acc) {
+        width = height = acc.header->image_size;
+    } else {
+        input = std::make_unique<png::image<png::gray_pixel_16>>(argv[1]);
+        width = input->get_width();
+        height = input->get_height();
+    }
 
-    for (png::uint_32 u = 0; u < input.get_height(); u++) {
-        for (png::uint_32 v = 0; v < input.get_width(); v++) {
-            output[u][v] = png::index_pixel(std::min(
-                255.0, 255.0 * std::sqrt(sigmoid(
-                                   brighten(input[u][v] * (1.0 / (1 << 16))),
-                                   amount))));
+    std::vector<std::unique_ptr<thumbnail>> thumbs;
+    for (int i = 3; i < argc; i++) {
+        const idx size = std::atoi(argv[i]);
+        // a thumbnail can only shrink the image, or some pixels get no input
+        if (size < 1 || size > std::max(width, height)) {
+            std::cerr << "thumbnail size " << argv[i]
+                      << " must be from 1 to the image size" << std::endl;
+            return 1;
         }
+        thumbs.emplace_back(std::make_unique<thumbnail>(size, width, height));
     }
 
-    output.write(filename_ss.str());
+    png::image<png::index_pixel> output(width, height);
+    output.set_palette(pal);
+    if (acc) {
+        colourize_accumulator(acc, output, thumbs, amount);
+    } else {
+        colourize_rows(
+            width, height,
+            [&](idx u, idx v) { return (*input)[u][v] * (1.0 / (1 << 16)); },
+            amount, output, thumbs);
+    }
+    output.write("cubehelix_" + name);
+
+    for (auto& t : thumbs) {
+        png::image<png::index_pixel> small(t->width, t->height);
+        small.set_palette(pal);
+        for (idx u = 0; u < t->height; u++) {
+            for (idx v = 0; v < t->width; v++) {
+                const idx k = u * t->width + v;
+                small[u][v] = t->count[k] > 0
+                                  ? colourize(t->sum[k] / t->count[k], amount)
+                                  : png::index_pixel(0);
+            }
+        }
+        std::stringstream filename_ss;
+        filename_ss << "cubehelix_" << std::max(t->width, t->height) << "_"
+                    << name;
+        small.write(filename_ss.str());
+    }
 }
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "buddhabrot.hpp"
+
+namespace buddha {
+
+/**
+ * Formula policy: a recurrence typed in at run time, such as "z^3 - z + c"
+ * or "conj(z)^2 + c", compiled into a register bytecode.
+ *
+ * The language has the variables z and c, the imaginary unit i, real
+ * numbers, + - * /, unary minus, ^ with a non-negative integer exponent,
+ * parentheses, and the functions conj, re, im and abs.
+ *
+ * Registers hold one complex number per lane, split into real and imaginary
+ * arrays. Register 0 is z and register 1 is c, followed by the constants and
+ * then one register per intermediate result. The interpreter runs each
+ * instruction over all lanes before moving on to the next, so decoding is
+ * paid once per batch of orbits and the inner loops can be vectorized.
+ */
+class expression_formula {
+   public:
+    static constexpr bool batched = true;
+    static constexpr bool cull_exterior = false;
+    static constexpr idx max_lanes = 16;
+
+   private:
+    enum opcode { add, sub, mul, div, neg, conj, re, im, abs };
+    struct instruction {
+        opcode op;
+        idx dst, a, b;
+    };
+
+    std::vector<instruction> code;
+    std::vector<double> reg_re, reg_im;
+    std::vector<bool> constant;
+    idx result = 0;
+    bool symmetric = true;
+
+    // parser state
+    std::string text;
+    std::size_t pos = 0;
+    std::string error;
+
+    idx new_register() {
+        reg_re.resize(reg_re.size() + max_lanes, 0);
+        reg_im.resize(reg_im.size() + max_lanes, 0);
+        constant.push_back(false);
+        return constant.size() - 1;
+    }
+
+    idx new_constant(const pt x) {
+        const idx r = new_register();
+        std::fill_n(reg_re.begin() + r * max_lanes, max_lanes, x.real());
+        std::fill_n(reg_im.begin() + r * max_lanes, max_lanes, x.imag());
+        constant[r] = true;
+        return r;
+    }
+
+    /**
+     * run one instruction over the first n lanes
+     */
+    void execute(const instruction& ins, const idx n) {
+        double* dr = reg_re.data() + ins.dst * max_lanes;
+        double* di = reg_im.data() + ins.dst * max_lanes;
+        const double* ar = reg_re.data() + ins.a * max_lanes;
+        const double* ai = reg_im.data() + ins.a * max_lanes;
+        const double* br = reg_re.data() + ins.b * max_lanes;
+        const double* bi = reg_im.data() + ins.b * max_lanes;
+        switch (ins.op) {
+            case add:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = ar[k] + br[k];
+                    di[k] = ai[k] + bi[k];
+                }
+                break;
+            case sub:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = ar[k] - br[k];
+                    di[k] = ai[k] - bi[k];
+                }
+                break;
+            case mul:
+                for (idx k = 0; k < n; k++) {
+                    const double x = ar[k] * br[k] - ai[k] * bi[k];
+                    di[k] = ar[k] * bi[k] + ai[k] * br[k];
+                    dr[k] = x;
+                }
+                break;
+            case div:
+                for (idx k = 0; k < n; k++) {
+                    const double d = br[k] * br[k] + bi[k] * bi[k];
+                    const double x = (ar[k] * br[k] + ai[k] * bi[k]) / d;
+                    di[k] = (ai[k] * br[k] - ar[k] * bi[k]) / d;
+                    dr[k] = x;
+                }
+                break;
+            case neg:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = -ar[k];
+                    di[k] = -ai[k];
+                }
+                break;
+            case conj:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = ar[k];
+                    di[k] = -ai[k];
+                }
+                break;
+            case re:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = ar[k];
+                    di[k] = 0;
+                }
+                break;
+            case im:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = ai[k];
+                    di[k] = 0;
+                }
+                break;
+            case abs:
+                for (idx k = 0; k < n; k++) {
+                    dr[k] = std::sqrt(ar[k] * ar[k] + ai[k] * ai[k]);
+                    di[k] = 0;
+                }
+                break;
+        }
+    }
+
+    /**
+     * emit an instruction, or fold it if its operands are constants
+     */
+    idx emit(const opcode op, const idx a, const idx b = -1) {
+        const instruction ins{op, new_register(), a, b < 0 ? a : b};
+        if (constant[ins.a] && constant[ins.b]) {
+            execute(ins, 1);
+            const pt x(reg_re[ins.dst * max_lanes],
+                       reg_im[ins.dst * max_lanes]);
+            constant.pop_back();
+            reg_re.resize(reg_re.size() - max_lanes);
+            reg_im.resize(reg_im.size() - max_lanes);
+            return new_constant(x);
+        }
+        code.push_back(ins);
+        return ins.dst;
+    }
+
+    void skip_space() {
+        while (pos < text.size() && std::isspace(text[pos])) pos++;
+    }
+
+    bool accept(const char ch) {
+        skip_space();
+        if (pos < text.size() && text[pos] == ch) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool fail(const std::string& message) {
+        if (error.empty()) {
+            error = message + " at column " + std::to_string(pos + 1);
+        }
+        return false;
+    }
+
+    // expression := term (('+' | '-') term)*
+    bool parse_expression(idx& r) {
+        if (!parse_term(r)) return false;
+        while (true) {
+            const bool plus = accept('+');
+            if (!plus && !accept('-')) return true;
+            idx rhs;
+            if (!parse_term(rhs)) return false;
+            r = emit(plus ? add : sub, r, rhs);
+        }
+    }
+
+    // term := unary (('*' | '/') unary)*
+    bool parse_term(idx& r) {
+        if (!parse_unary(r)) return false;
+        while (true) {
+            const bool times = accept('*');
+            if (!times && !accept('/')) return true;
+            idx rhs;
+            if (!parse_unary(rhs)) return false;
+            r = emit(times ? mul : div, r, rhs);
+        }
+    }
+
+    // unary := '-' unary | power
+    bool parse_unary(idx& r) {
+        if (accept('-')) {
+            if (!parse_unary(r)) return false;
+            r = emit(neg, r);
+            return true;
+        }
+        return parse_power(r);
+    }
+
+    // power := primary ('^' integer)?, computed by repeated squaring
+    bool parse_power(idx& r) {
+        if (!parse_primary(r)) return false;
+        if (!accept('^')) return true;
+        skip_space();
+        char* end;
+        const long e = std::strtol(text.c_str() + pos, &end, 10);
+        if (end == text.c_str() + pos || e < 0 || e > 64) {
+            return fail("expected an exponent from 0 to 64");
+        }
+        pos = end - text.c_str();
+        idx base = r;
+        r = -1;
+        for (long k = e; k > 0; k >>= 1) {
+            if (k & 1) r = r < 0 ? base : emit(mul, r, base);
+            if (k > 1) base = emit(mul, base, base);
+        }
+        if (r < 0) r = new_constant(1);
+        return true;
+    }
+
+    // primary := number | z | c | i | function '(' expression ')'
+    //          | '(' expression ')'
+    bool parse_primary(idx& r) {
+        skip_space();
+        if (accept('(')) {
+            if (!parse_expression(r)) return false;
+            return accept(')') || fail("expected )");
+        }
+        if (pos < text.size() &&
+            (std::isdigit(text[pos]) || text[pos] == '.')) {
+            char* end;
+            const double x = std::strtod(text.c_str() + pos, &end);
+            pos = end - text.c_str();
+            r = new_constant(x);
+            return true;
+        }
+        std::string name;
+        while (pos < text.size() && std::isalpha(text[pos])) {
+            name.push_back(text[pos++]);
+        }
+        if (name == "z") {
+            r = 0;
+        } else if (name == "c") {
+            r = 1;
+        } else if (name == "i") {
+            r = new_constant(pt(0, 1));
+            symmetric = false;
+        } else if (name == "conj" || name == "re" || name == "im" ||
+                   name == "abs") {
+            if (!accept('(')) return fail("expected (");
+            idx arg;
+            if (!parse_expression(arg)) return false;
+            if (!accept(')')) return fail("expected )");
+            const opcode op = name == "conj" ? conj
+                              : name == "re" ? re
+                              : name == "im" ? im
+                                             : abs;
+            symmetric = symmetric && op != im;
+            r = emit(op, arg);
+        } else {
+            return fail(name.empty() ? "expected a value"
+                                     : "unknown name " + name);
+        }
+        return true;
+    }
+
+   public:
+    /**
+     * Compile a formula. If it doesn't parse, the formula tests false and
+     * error_message() says why.
+     */
+    explicit expression_formula(const std::string& text_) : text(text_) {
+        new_register();  // z
+        new_register();  // c
+        if (!parse_expression(result)) return;
+        skip_space();
+        if (pos != text.size()) fail("unexpected " + text.substr(pos));
+    }
+
+    explicit operator bool() const { return error.empty(); }
+
+    const std::string& error_message() const { return error; }
+
+    /**
+     * whether the formula commutes with complex conjugation, so that the
+     * image is symmetric about the real axis
+     */
+    bool conjugate_symmetric() const { return symmetric; }
+
+    /**
+     * next[k] = f(z[k], c[k]) for k < n, max_lanes at a time
+     */
+    void operator()(const pt* z, const pt* c, pt* next, const idx n) {
+        for (idx k0 = 0; k0 < n; k0 += max_lanes) {
+            const idx m = std::min(max_lanes, n - k0);
+            for (idx k = 0; k < m; k++) {
+                reg_re[k] = z[k0 + k].real();
+                reg_im[k] = z[k0 + k].imag();
+                reg_re[max_lanes + k] = c[k0 + k].real();
+                reg_im[max_lanes + k] = c[k0 + k].imag();
+            }
+            for (const instruction& ins : code) {
+                execute(ins, m);
+            }
+            for (idx k = 0; k < m; k++) {
+                next[k0 + k] = pt(reg_re[result * max_lanes + k],
+                                  reg_im[result * max_lanes + k]);
+            }
+        }
+    }
+
+    pt operator()(const pt z, const pt c) {
+        pt next;
+        (*this)(&z, &c, &next, 1);
+        return next;
+    }
+};
+
+}  // namespace buddha
@@ -0,0 +1,397 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buddhabrot.hpp"
+
+namespace buddha {
+
+/**
+ * A small render farm protocol over TCP.
+ *
+ * The coordinator owns the merged image and hands out ranges of rows of cells
+ * to workers on demand, so that fast workers simply ask for more work. Each
+ * worker renders every range it is given into one local accumulator, and when
+ * the coordinator runs out of rows it streams the accumulator back in bands
+ * of rows, which the coordinator adds to the merged image as they arrive.
+ *
+ * Every message starts with a farm_message header. Only hello and tile
+ * messages carry a payload: a hello is followed by the worker's
+ * farm_settings, and a tile by b * image_size doubles for rows [a, a + b).
+ *
+ *   worker                         coordinator
+ *   hello(size, iterations, samples) + settings ->
+ *   request                        ->
+ *                                  <- range(u0, u1) or done
+ *   ... until done ...
+ *   tile(row0, rows) + payload     ->
+ *   finished                       ->
+ */
+struct farm_message {
+    enum kind : std::int64_t { hello, request, range, done, tile, finished };
+    std::int64_t type, a, b, c;
+};
+
+/**
+ * The render settings a worker sends with its hello. The coordinator only
+ * accepts workers whose settings match its own, since otherwise the merged
+ * image would mix renders of different images.
+ */
+struct farm_settings {
+    std::int64_t bilinear, min_iterations, julia;
+    double julia_re, julia_im, roulette;
+    std::int64_t roulette_max_path;
+};
+
+inline farm_settings make_farm_settings(const render_settings& settings) {
+    return farm_settings{settings.bilinear,
+                         settings.min_iterations,
+                         settings.julia,
+                         settings.julia_c.real(),
+                         settings.julia_c.imag(),
+                         settings.roulette,
+                         settings.roulette_max_path};
+}
+
+inline bool same_settings(const farm_settings& a, const farm_settings& b) {
+    return a.bilinear == b.bilinear && a.min_iterations == b.min_iterations &&
+           a.julia == b.julia && a.julia_re == b.julia_re &&
+           a.julia_im == b.julia_im && a.roulette == b.roulette &&
+           a.roulette_max_path == b.roulette_max_path;
+}
+
+/**
+ * send or receive exactly n bytes, returning false on error or disconnect
+ */
+inline bool send_all(const int fd, const void* data, std::size_t n) {
+    const char* p = static_cast<const char*>(data);
+    while (n > 0) {
+        const ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+inline bool recv_all(const int fd, void* data, std::size_t n) {
+    char* p = static_cast<char*>(data);
+    while (n > 0) {
+        const ssize_t k = ::recv(fd, p, n, 0);
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+inline bool send_message(const int fd, const std::int64_t type,
+                         const std::int64_t a = 0, const std::int64_t b = 0,
+                         const std::int64_t c = 0) {
+    const farm_message m{type, a, b, c};
+    return send_all(fd, &m, sizeof(m));
+}
+
+/**
+ * split "host:port" or "port" into its parts, defaulting to the loopback
+ * interface
+ */
+inline bool parse_address(const std::string& address, std::string& host,
+                          int& port) {
+    const auto colon = address.rfind(':');
+    host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    port = std::atoi(address.c_str() + (colon == std::string::npos ? 0 : colon + 1));
+    return port > 0 && port < 65536;
+}
+
+inline sockaddr_in make_address(const std::string& host, const int port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        addr.sin_addr.s_addr = htonl(INADDR_NONE);
+    }
+    return addr;
+}
+
+/**
+ * open a listening socket, returning -1 on failure
+ */
+inline int farm_listen(const std::string& host, const int port) {
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    const sockaddr_in addr = make_address(host, port);
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        ::listen(fd, 64) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * connect to a coordinator, retrying for a few seconds in case it is still
+ * starting up. Returns -1 on failure.
+ */
+inline int farm_connect(const std::string& host, const int port) {
+    const sockaddr_in addr = make_address(host, port);
+    for (int attempt = 0; attempt < 50; attempt++) {
+        const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr),
+                      sizeof(addr)) == 0) {
+            const int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return -1;
+}
+
+/**
+ * Run one worker connection: render ranges of rows until the coordinator says
+ * done, then stream the accumulated image back.
+ *
+ * make_renderer(scheduler) must return a std::unique_ptr to a renderer using
+ * a pull_scheduler and an accumulator with data().
+ */
+template <typename MakeRenderer>
+bool farm_worker(const int fd, const idx image_size, const idx iterations,
+                 const idx max_samples, const render_settings& settings,
+                 MakeRenderer make_renderer) {
+    constexpr idx rows_per_tile = 16;
+    const farm_settings ours = make_farm_settings(settings);
+    if (!send_message(fd, farm_message::hello, image_size, iterations,
+                      max_samples) ||
+        !send_all(fd, &ours, sizeof(ours))) {
+        return false;
+    }
+    bool ok = true;
+    idx rendered = 0;
+    auto brot = make_renderer(pull_scheduler{[&](idx& u0, idx& u1) {
+        farm_message m;
+        if (!ok || !send_message(fd, farm_message::request) ||
+            !recv_all(fd, &m, sizeof(m))) {
+            ok = false;
+            return false;
+        }
+        if (m.type != farm_message::range) return false;
+        u0 = m.a;
+        u1 = m.b;
+        rendered += u1 - u0;
+        return true;
+    }});
+    brot->render();
+    if (!ok) return false;
+
+    if (rendered > 0) {
+        const double* data = brot->accumulator().data();
+        for (idx row0 = 0; row0 < image_size; row0 += rows_per_tile) {
+            const idx rows = std::min(rows_per_tile, image_size - row0);
+            if (!send_message(fd, farm_message::tile, row0, rows) ||
+                !send_all(fd, data + row0 * image_size,
+                          rows * image_size * sizeof(double))) {
+                return false;
+            }
+        }
+    }
+    return send_message(fd, farm_message::finished);
+}
+
+/**
+ * Run the coordinator on a listening socket until every row of cells has been
+ * rendered and added into image (row-major, image_size * image_size, summed
+ * over workers but not yet folded).
+ *
+ * A worker that asks for more work once every range has been handed out is
+ * kept waiting, and only told it is done once every other worker is waiting
+ * too. So if a worker disconnects before it starts returning its results, the
+ * ranges it had been given can be handed out again to the ones still waiting.
+ * If that leaves ranges that no worker can take, the coordinator waits a
+ * while for a new worker to connect, then gives up.
+ */
+inline bool farm_coordinator(const int listen_fd, const idx image_size,
+                             const idx iterations, const idx max_samples,
+                             const render_settings& settings, double* image) {
+    constexpr int orphan_timeout_ms = 60000;
+    const farm_settings ours = make_farm_settings(settings);
+    struct worker {
+        std::vector<std::pair<idx, idx>> ranges;
+        bool greeted = false;  // has sent a matching hello
+        bool waiting = false;  // has asked for work and not been answered
+        bool released = false;  // has been told it is done
+        bool sending = false;
+    };
+    const idx rows_per_range = std::max<idx>(1, image_size / 256);
+    std::deque<std::pair<idx, idx>> pending;
+    for (idx u = 0; u < image_size; u += rows_per_range) {
+        pending.emplace_back(u, std::min(image_size, u + rows_per_range));
+    }
+    std::map<int, worker> workers;
+    bool had_workers = false;
+    idx merged_workers = 0;
+    std::vector<double> tile;
+
+    auto drop = [&](const int fd) {
+        auto& w = workers[fd];
+        if (w.sending) {
+            std::cerr << "worker lost while sending results" << std::endl;
+            return false;
+        }
+        pending.insert(pending.end(), w.ranges.begin(), w.ranges.end());
+        workers.erase(fd);
+        ::close(fd);
+        return true;
+    };
+
+    // we are finished once every range has been handed out and nobody is
+    // still holding rendered rows
+    auto busy = [&]() {
+        if (!pending.empty()) return true;
+        for (auto& [fd, w] : workers) {
+            if (!w.ranges.empty()) return true;
+        }
+        return false;
+    };
+
+    // answer waiting workers with pending ranges, and once there are none
+    // left and every worker that could still render is waiting, release them
+    auto dispatch = [&]() {
+        bool all_waiting = true;
+        for (auto& [fd, w] : workers) {
+            if (!w.greeted || w.released) continue;
+            if (w.waiting && !pending.empty()) {
+                const auto r = pending.front();
+                pending.pop_front();
+                w.ranges.push_back(r);
+                w.waiting = false;
+                if (!send_message(fd, farm_message::range, r.first, r.second)) {
+                    // picked up as a disconnect by the next poll
+                    continue;
+                }
+            }
+            all_waiting = all_waiting && w.waiting;
+        }
+        if (!pending.empty() || !all_waiting) return;
+        for (auto& [fd, w] : workers) {
+            if (!w.greeted || w.released) continue;
+            w.waiting = false;
+            w.released = true;
+            send_message(fd, farm_message::done);
+        }
+    };
+
+    auto can_render = [&]() {
+        for (auto& [fd, w] : workers) {
+            if (w.greeted && !w.released) return true;
+        }
+        return false;
+    };
+
+    while (busy()) {
+        dispatch();
+        std::vector<pollfd> fds{{listen_fd, POLLIN, 0}};
+        for (auto& [fd, w] : workers) {
+            fds.push_back({fd, POLLIN, 0});
+        }
+        const bool orphaned = had_workers && !pending.empty() && !can_render();
+        const int ready =
+            ::poll(fds.data(), fds.size(), orphaned ? orphan_timeout_ms : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (ready == 0) {
+            std::cerr << "no workers left to render the remaining rows"
+                      << std::endl;
+            return false;
+        }
+        if (fds[0].revents & POLLIN) {
+            const int fd = ::accept(listen_fd, nullptr, nullptr);
+            // its hello is read below once it arrives, like any message
+            if (fd >= 0) workers[fd];
+        }
+        for (std::size_t i = 1; i < fds.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            const int fd = fds[i].fd;
+            auto& w = workers[fd];
+            farm_message m;
+            if (!recv_all(fd, &m, sizeof(m))) {
+                if (!drop(fd)) return false;
+                continue;
+            }
+            if (!w.greeted) {
+                farm_settings theirs;
+                if (m.type == farm_message::hello &&
+                    !recv_all(fd, &theirs, sizeof(theirs))) {
+                    drop(fd);
+                    continue;
+                }
+                if (m.type == farm_message::hello && m.a == image_size &&
+                    m.b == iterations && m.c == max_samples &&
+                    same_settings(theirs, ours)) {
+                    w.greeted = true;
+                    had_workers = true;
+                } else {
+                    std::cerr << "rejected worker with different parameters"
+                              << std::endl;
+                    send_message(fd, farm_message::done);
+                    drop(fd);
+                }
+            } else if (m.type == farm_message::request) {
+                if (w.released) {
+                    send_message(fd, farm_message::done);
+                } else {
+                    w.waiting = true;
+                }
+            } else if (m.type == farm_message::tile) {
+                if (m.a < 0 || m.b < 0 || m.a + m.b > image_size) {
+                    std::cerr << "bad tile from worker" << std::endl;
+                    return false;
+                }
+                tile.resize(m.b * image_size);
+                if (!recv_all(fd, tile.data(), tile.size() * sizeof(double))) {
+                    drop(fd);
+                    return false;
+                }
+                w.sending = true;
+                double* dst = image + m.a * image_size;
+                for (std::size_t k = 0; k < tile.size(); k++) {
+                    dst[k] += tile[k];
+                }
+            } else if (m.type == farm_message::finished) {
+                if (!w.ranges.empty()) merged_workers++;
+                workers.erase(fd);
+                ::close(fd);
+            }
+        }
+    }
+    for (auto& [fd, w] : workers) {
+        send_message(fd, farm_message::done);
+        ::close(fd);
+    }
+    std::cerr << "merged results from " << merged_workers << " workers"
+              << std::endl;
+    return true;
+}
+
+}  // namespace buddha
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buddhabrot.hpp"
+
+namespace buddha {
+
+/**
+ * Streams tone mapped frames as raw video to stdout or a file such as a
+ * FIFO, for piping straight into a video encoder. Each frame is
+ * image_size * image_size pixels in row-major order, either gray16le (one
+ * little-endian uint16 per pixel) or rgb48le (the same value in each of 3
+ * channels, for encoders that only take RGB input).
+ *
+ * Frames are converted into one buffer while a background thread writes the
+ * other, so the renderer only waits when the reader falls behind.
+ */
+class frame_stream {
+   private:
+    const idx image_size;
+    const idx channels;
+    int fd = -1;
+
+    std::vector<std::uint16_t> front, back;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool back_full = false;
+    bool stopping = false;
+    bool failed = false;
+    std::thread writer;
+
+    /**
+     * x as stored in little-endian order, whatever the host's byte order
+     */
+    static std::uint16_t little_endian(const std::uint16_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return static_cast<std::uint16_t>((x >> 8) | (x << 8));
+#else
+        return x;
+#endif
+    }
+
+    bool write_all(const std::vector<std::uint16_t>& frame) {
+        const char* p = reinterpret_cast<const char*>(frame.data());
+        std::size_t n = frame.size() * sizeof(std::uint16_t);
+        while (n > 0) {
+            const ssize_t k = ::write(fd, p, n);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+            p += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&]() { return back_full || stopping; });
+            if (!back_full) return;
+            lock.unlock();
+            const bool ok = write_all(back);
+            lock.lock();
+            failed = failed || !ok;
+            back_full = false;
+            cv.notify_all();
+        }
+    }
+
+   public:
+    /**
+     * open path for writing, or stdout if path is "-". format is "gray16le"
+     * or "rgb48le". Opening a FIFO waits for a reader.
+     */
+    frame_stream(const std::string& path, const std::string& format,
+                 const idx image_size_)
+        : image_size(image_size_), channels(format == "rgb48le" ? 3 : 1) {
+        if (format != "gray16le" && format != "rgb48le") return;
+        fd = path == "-" ? STDOUT_FILENO
+                         : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                  0644);
+        if (fd < 0) return;
+        front.resize(image_size * image_size * channels);
+        back.resize(front.size());
+        writer = std::thread([this]() { write_loop(); });
+    }
+
+    ~frame_stream() { close(); }
+
+    frame_stream(const frame_stream&) = delete;
+    frame_stream& operator=(const frame_stream&) = delete;
+
+    explicit operator bool() const { return fd >= 0; }
+
+    /**
+     * tone map and queue a frame, given as a row-major image of
+     * image_size * image_size values. Returns false if an earlier frame
+     * failed to write, e.g. because the reader went away.
+     */
+    bool add(const std::vector<double>& image, const value_range& range,
+             const idx n_threads) {
+        parallel_for(n_threads, image_size, [&](idx u) {
+            std::uint16_t* row = front.data() + u * image_size * channels;
+            for (idx v = 0; v < image_size; v++) {
+                const double y = tone_map(image[u * image_size + v], range);
+                const std::uint16_t x = little_endian(((1 << 16) - 1) * y);
+                for (idx k = 0; k < channels; k++) {
+                    row[v * channels + k] = x;
+                }
+            }
+        });
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return !back_full; });
+        front.swap(back);
+        back_full = true;
+        cv.notify_all();
+        return !failed;
+    }
+
+    /**
+     * write out the last frame and stop the writer thread. Returns false if
+     * anything failed to write.
+     */
+    bool close() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            writer.join();
+            if (fd != STDOUT_FILENO) ::close(fd);
+        }
+        return !failed;
+    }
+};
+
+}  // namespace buddha
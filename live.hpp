@@ -0,0 +1,123 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "buddhabrot.hpp"
+
+namespace buddha {
+
+/**
+ * Header of a live accumulator in POSIX shared memory.
+ *
+ * It is followed, at offset sizeof(live_header), by planes + 1 images of
+ * image_size * image_size doubles each in row-major order. Each render thread
+ * splats straight into its own plane, and the last image is their sum, the
+ * current linear density before folding about the real axis.
+ *
+ * The counters and the sum are updated a few times a second, and generation
+ * is bumped after every update, so a viewer can poll it to see when to
+ * redraw.
+ */
+struct alignas(64) live_header {
+    char magic[8];
+    std::int64_t image_size;
+    std::int64_t planes;
+    std::atomic<std::uint64_t> generation;
+    std::atomic<std::int64_t> cells_done;   // cells of the grid rendered
+    std::atomic<std::int64_t> cells_total;  // cells to render in all passes
+    std::atomic<std::int64_t> samples;      // orbits sampled so far
+    std::atomic<std::int64_t> finished;     // 1 once rendering is done
+};
+
+constexpr char live_magic[8] = {'B', 'U', 'D', 'L', 'I', 'V', 'E', '1'};
+
+/**
+ * A live accumulator segment created by the renderer. Creating it fails if
+ * the name is taken, unless overwrite is set, in which case the old segment
+ * is unlinked first, so that viewers of it keep what they have mapped. The
+ * segment name is unlinked again when this is destroyed; viewers that still
+ * have it mapped keep their view of the final image.
+ */
+class live_segment {
+   private:
+    std::string name;
+    void* mapping = MAP_FAILED;
+    std::size_t length = 0;
+
+   public:
+    live_header* header = nullptr;
+
+    live_segment(const std::string& name_, const idx image_size,
+                 const idx planes, const bool overwrite)
+        : name(name_[0] == '/' ? name_ : "/" + name_) {
+        length = sizeof(live_header) +
+                 (planes + 1) * image_size * image_size * sizeof(double);
+        if (overwrite) {
+            ::shm_unlink(name.c_str());
+        }
+        const int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR | O_EXCL, 0644);
+        if (fd < 0) return;
+        if (::ftruncate(fd, length) == 0) {
+            mapping = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            ::shm_unlink(name.c_str());
+            return;
+        }
+        header = new (mapping) live_header;
+        header->image_size = image_size;
+        header->planes = planes;
+        header->generation = 0;
+        header->cells_done = 0;
+        header->cells_total = 0;
+        header->samples = 0;
+        header->finished = 0;
+        // write the magic last, so a viewer never sees a half-made header
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(header->magic, live_magic, sizeof(header->magic));
+    }
+
+    ~live_segment() {
+        if (mapping != MAP_FAILED) {
+            ::munmap(mapping, length);
+            ::shm_unlink(name.c_str());
+        }
+    }
+
+    live_segment(const live_segment&) = delete;
+    live_segment& operator=(const live_segment&) = delete;
+
+    explicit operator bool() const { return header != nullptr; }
+
+    double* plane(const idx i) {
+        return reinterpret_cast<double*>(header + 1) +
+               i * header->image_size * header->image_size;
+    }
+
+    /**
+     * add up the planes into the image after them
+     */
+    void update_sum() {
+        const idx n = header->image_size * header->image_size;
+        double* sum = plane(header->planes);
+        std::fill_n(sum, n, 0.0);
+        for (idx i = 0; i < header->planes; i++) {
+            const double* p = plane(i);
+            for (idx k = 0; k < n; k++) {
+                sum[k] += p[k];
+            }
+        }
+    }
+};
+
+}  // namespace buddha
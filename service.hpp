@@ -0,0 +1,379 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "buddhabrot.hpp"
+#include "farm.hpp"
+
+namespace buddha {
+
+/**
+ * A render requested from the service. The job owns the client connection.
+ */
+struct render_job {
+    int fd = -1;
+    idx image_size = 0, iterations = 0, max_samples = 0;
+    render_settings settings;
+    double denoise = 0;
+    std::string output;
+    std::string input;  // received from the client but not yet handled
+};
+
+/**
+ * Parse a request of the form
+ *
+ *   image_size iterations max_samples output_path [--bilinear]
+ *   [--roulette p] [--min-iterations k] [--denoise s]
+ */
+inline bool parse_job(const std::string& line, render_job& job) {
+    std::istringstream in(line);
+    if (!(in >> job.image_size >> job.iterations >> job.max_samples >>
+          job.output) ||
+        job.image_size <= 0 || job.iterations <= 0 || job.max_samples <= 0) {
+        return false;
+    }
+    std::string arg;
+    while (in >> arg) {
+        if (arg == "--bilinear") {
+            job.settings.bilinear = true;
+        } else if (arg == "--roulette" && in >> job.settings.roulette &&
+                   job.settings.roulette > 0 && job.settings.roulette <= 1) {
+        } else if (arg == "--min-iterations" &&
+                   in >> job.settings.min_iterations &&
+                   job.settings.min_iterations >= 0) {
+        } else if (arg == "--denoise" && in >> job.denoise) {
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * append whatever a client has sent so far to buffer, without blocking.
+ * Returns false if the client has hung up or sent too much.
+ */
+inline bool recv_available(const int fd, std::string& buffer) {
+    char chunk[256];
+    while (buffer.size() < 4096) {
+        const ssize_t k = ::recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (k > 0) {
+            buffer.append(chunk, k);
+        } else if (k < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+    return false;
+}
+
+/**
+ * move the first complete line out of buffer, if there is one
+ */
+inline bool take_line(std::string& buffer, std::string& line) {
+    const auto newline = buffer.find('\n');
+    if (newline == std::string::npos) return false;
+    line = buffer.substr(0, newline);
+    buffer.erase(0, newline + 1);
+    return true;
+}
+
+/**
+ * whether path could be written: either it is a writable file, or it doesn't
+ * exist and its directory is writable
+ */
+inline bool writable(const std::string& path) {
+    if (::access(path.c_str(), F_OK) == 0) {
+        return ::access(path.c_str(), W_OK) == 0;
+    }
+    const auto slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "."
+                            : slash == 0               ? "/"
+                                                       : path.substr(0, slash);
+    return ::access(dir.c_str(), W_OK | X_OK) == 0;
+}
+
+inline void send_line(const int fd, const std::string& line) {
+    const std::string s = line + "\n";
+    send_all(fd, s.data(), s.size());
+}
+
+/**
+ * A long-running render service on a Unix domain socket.
+ *
+ * Each client connects, sends one request line (see parse_job) and then
+ * receives status lines: "queued n", "progress x" with x in [0, 1], and
+ * finally "done path", "cancelled" or "error message". Sending "cancel" or
+ * closing the connection cancels the job, whether it is queued or running.
+ *
+ * Jobs run one at a time, each spread over a pool of threads that persists
+ * between jobs. The renderers (and so their accumulators and trajectory
+ * buffers) are kept warm and cleared for the next job if it has the same
+ * parameters, and released as soon as a job is cancelled.
+ *
+ * write_output(path, brots, image_size, n_threads, denoise) writes a finished
+ * render, returning false if it can't.
+ */
+template <typename Write>
+class render_service {
+   private:
+    using renderer = buddhabrot<mandelbrot_formula, uniform_sampler,
+                                vector_accumulator, pull_scheduler>;
+
+    const idx n_threads;
+    Write write_output;
+
+    // renderers kept warm between jobs, and the job they were set up for
+    std::vector<std::unique_ptr<renderer>> brots;
+    render_job warm;
+
+    // progress of the running job, shared with the pool
+    idx image_size = 0;
+    std::atomic<idx> next_row{0};
+    std::atomic<bool> cancelled{false};
+
+    // the thread pool
+    std::mutex pool_mutex;
+    std::condition_variable pool_cv;
+    idx generation = 0;
+    idx running = 0;
+    bool stopping = false;
+    std::vector<std::thread> pool;
+
+    // jobs waiting to run
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<render_job> queue;
+
+    void pool_thread(const idx i) {
+        idx seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                pool_cv.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            brots[i]->render();
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                running--;
+            }
+            pool_cv.notify_all();
+        }
+    }
+
+    /**
+     * check a client connection for a cancel request or hangup, without
+     * blocking
+     */
+    static bool client_cancelled(render_job& job) {
+        const bool open = recv_available(job.fd, job.input);
+        std::string line;
+        while (take_line(job.input, line)) {
+            if (line == "cancel") return true;
+        }
+        return !open;
+    }
+
+    /**
+     * set up warm renderers for a job, reusing the previous ones if possible
+     */
+    void prepare(const render_job& job) {
+        if (!brots.empty() && job.image_size == warm.image_size &&
+            job.iterations == warm.iterations &&
+            job.max_samples == warm.max_samples &&
+            job.settings.bilinear == warm.settings.bilinear &&
+            job.settings.roulette == warm.settings.roulette &&
+            job.settings.min_iterations == warm.settings.min_iterations) {
+            parallel_for(n_threads, n_threads,
+                         [&](idx i) { brots[i]->accumulator().clear(); });
+            return;
+        }
+        brots.clear();
+        for (idx i = 0; i < n_threads; i++) {
+            std::random_device rd;
+            brots.emplace_back(std::make_unique<renderer>(
+                job.image_size, job.iterations, job.max_samples,
+                uniform_sampler(rd() + i), vector_accumulator(job.image_size),
+                pull_scheduler{[this](idx& u0, idx& u1) {
+                    if (cancelled) return false;
+                    u0 = next_row++;
+                    u1 = u0 + 1;
+                    return u0 < image_size;
+                }},
+                job.settings));
+        }
+        warm = job;
+    }
+
+    void run(render_job& job) {
+        if (client_cancelled(job)) {
+            send_line(job.fd, "cancelled");
+            return;
+        }
+        prepare(job);
+        image_size = job.image_size;
+        next_row = 0;
+        cancelled = false;
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            running = n_threads;
+            generation++;
+        }
+        pool_cv.notify_all();
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                if (pool_cv.wait_for(lock, std::chrono::milliseconds(500),
+                                     [&]() { return running == 0; })) {
+                    break;
+                }
+            }
+            if (!cancelled && client_cancelled(job)) {
+                cancelled = true;
+            }
+            std::ostringstream progress;
+            progress << "progress " << std::fixed << std::setprecision(3)
+                     << std::min<double>(1.0, next_row / double(image_size));
+            send_line(job.fd, progress.str());
+        }
+
+        if (cancelled) {
+            // free the accumulators and buffers straight away
+            brots.clear();
+            send_line(job.fd, "cancelled");
+            return;
+        }
+        bool written = false;
+        try {
+            written = write_output(job.output, brots, job.image_size,
+                                   n_threads, job.denoise);
+        } catch (const std::exception&) {
+        }
+        send_line(job.fd, written ? "done " + job.output
+                                  : "error could not write " + job.output);
+    }
+
+   public:
+    render_service(const idx n_threads_, Write write_output_)
+        : n_threads(n_threads_), write_output(std::move(write_output_)) {
+        for (idx i = 0; i < n_threads; i++) {
+            pool.emplace_back([this, i]() { pool_thread(i); });
+        }
+    }
+
+    ~render_service() {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            stopping = true;
+        }
+        pool_cv.notify_all();
+        for (auto& t : pool) {
+            t.join();
+        }
+    }
+
+    /**
+     * listen on a Unix domain socket at path and serve jobs forever.
+     * Returns false if the socket can't be opened.
+     */
+    bool serve(const std::string& path) {
+        const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (listen_fd < 0 || path.size() >= sizeof(addr.sun_path)) {
+            return false;
+        }
+        path.copy(addr.sun_path, path.size());
+        ::unlink(path.c_str());
+        if (::bind(listen_fd, reinterpret_cast<const sockaddr*>(&addr),
+                   sizeof(addr)) < 0 ||
+            ::listen(listen_fd, 64) < 0) {
+            ::close(listen_fd);
+            return false;
+        }
+
+        // wait for request lines from all new clients at once, so that a slow
+        // or silent one doesn't hold up the others
+        std::thread acceptor([&]() {
+            using clock = std::chrono::steady_clock;
+            constexpr auto request_timeout = std::chrono::seconds(10);
+            std::vector<std::pair<render_job, clock::time_point>> clients;
+            while (true) {
+                std::vector<pollfd> fds{{listen_fd, POLLIN, 0}};
+                for (const auto& client : clients) {
+                    fds.push_back({client.first.fd, POLLIN, 0});
+                }
+                if (::poll(fds.data(), fds.size(), 1000) < 0) continue;
+                if (fds[0].revents & POLLIN) {
+                    const int fd = ::accept(listen_fd, nullptr, nullptr);
+                    if (fd >= 0) {
+                        render_job job;
+                        job.fd = fd;
+                        clients.emplace_back(job, clock::now() + request_timeout);
+                    }
+                }
+                for (std::size_t i = clients.size(); i-- > 0;) {
+                    render_job& job = clients[i].first;
+                    const bool open = i + 1 >= fds.size() ||
+                                      !fds[i + 1].revents ||
+                                      recv_available(job.fd, job.input);
+                    std::string line;
+                    if (take_line(job.input, line)) {
+                        if (!parse_job(line, job)) {
+                            send_line(job.fd, "error bad request");
+                            ::close(job.fd);
+                        } else if (!writable(job.output)) {
+                            send_line(job.fd,
+                                      "error could not write " + job.output);
+                            ::close(job.fd);
+                        } else {
+                            std::lock_guard<std::mutex> lock(queue_mutex);
+                            queue.push_back(job);
+                            send_line(job.fd, "queued " +
+                                                  std::to_string(queue.size()));
+                            queue_cv.notify_one();
+                        }
+                    } else if (!open || clock::now() > clients[i].second) {
+                        send_line(job.fd, "error bad request");
+                        ::close(job.fd);
+                    } else {
+                        continue;
+                    }
+                    clients.erase(clients.begin() + i);
+                }
+            }
+        });
+        acceptor.detach();
+
+        while (true) {
+            render_job job;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [&]() { return !queue.empty(); });
+                job = queue.front();
+                queue.pop_front();
+            }
+            run(job);
+            ::close(job.fd);
+        }
+    }
+};
+
+}  // namespace buddha
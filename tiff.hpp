@@ -0,0 +1,171 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "buddhabrot.hpp"
+
+namespace buddha {
+
+/**
+ * A BigTIFF file under construction, assembled in memory one field at a time
+ * in little-endian order.
+ */
+class tiff_buffer {
+   public:
+    std::vector<unsigned char> bytes;
+
+    template <typename T>
+    void put(const T x) {
+        const auto p = reinterpret_cast<const unsigned char*>(&x);
+        bytes.insert(bytes.end(), p, p + sizeof(x));
+    }
+
+    /**
+     * an IFD entry holding a single value that fits in the entry itself
+     */
+    void entry(const std::uint16_t tag, const std::uint16_t type,
+               const std::uint64_t value) {
+        put(tag);
+        put(type);
+        put(std::uint64_t(1));
+        put(value);
+    }
+
+    /**
+     * an IFD entry for an array of LONG8s, stored at offset unless there is
+     * only one, which the format requires to be stored in the entry itself
+     */
+    void array_entry(const std::uint16_t tag,
+                     const std::vector<std::uint64_t>& values,
+                     const std::uint64_t offset) {
+        put(tag);
+        put(std::uint16_t(16));
+        put(std::uint64_t(values.size()));
+        put(values.size() == 1 ? values[0] : offset);
+    }
+};
+
+/**
+ * Write a grayscale image as a tiled BigTIFF with deflate compressed tiles,
+ * where value(u, v) in [0, 1] is the pixel in row u and column v. bits is
+ * 16 for unsigned 16-bit samples, or 32 for float32 samples, which keep the
+ * full precision of the tone mapped image.
+ *
+ * Tiles are compressed in parallel, and each thread appends its tiles to the
+ * file as soon as they are done, at an offset it reserves atomically, so the
+ * tiles end up in no particular order. Once all are written, their offsets
+ * go into the directory at the end of the file. Any region can then be read
+ * by decompressing just the tiles that cover it.
+ *
+ * Returns false if the file can't be written.
+ */
+template <typename Value>
+bool write_tiff(const std::string& filename, const idx width,
+                const idx height, const idx bits, const idx n_threads,
+                Value value) {
+    constexpr idx tile = 256;
+    const idx bytes_per_sample = bits / 8;
+    const idx tiles_across = (width + tile - 1) / tile;
+    const idx tiles_down = (height + tile - 1) / tile;
+    const idx n_tiles = tiles_across * tiles_down;
+
+    const int fd =
+        ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    // the header, pointing at a directory that is only written at the end
+    constexpr std::uint64_t header_size = 16;
+    std::atomic<std::uint64_t> end(header_size);
+    std::vector<std::uint64_t> offsets(n_tiles), byte_counts(n_tiles);
+    std::atomic<bool> ok(true);
+
+    parallel_for(n_threads, n_tiles, [&](idx t) {
+        const idx u0 = (t / tiles_across) * tile;
+        const idx v0 = (t % tiles_across) * tile;
+        // tiles past the edge of the image are padded with zeros
+        std::vector<unsigned char> raw(tile * tile * bytes_per_sample, 0);
+        for (idx u = u0; u < std::min(height, u0 + tile); u++) {
+            unsigned char* row =
+                raw.data() + (u - u0) * tile * bytes_per_sample;
+            if (bits == 16) {
+                // horizontal differencing (predictor 2) helps deflate a lot
+                std::uint16_t previous = 0;
+                for (idx v = v0; v < std::min(width, v0 + tile); v++) {
+                    const std::uint16_t x = ((1 << 16) - 1) * value(u, v);
+                    const std::uint16_t delta = x - previous;
+                    std::memcpy(row + (v - v0) * 2, &delta, 2);
+                    previous = x;
+                }
+            } else {
+                for (idx v = v0; v < std::min(width, v0 + tile); v++) {
+                    const float x = value(u, v);
+                    std::memcpy(row + (v - v0) * 4, &x, 4);
+                }
+            }
+        }
+        uLongf size = ::compressBound(raw.size());
+        std::vector<unsigned char> compressed(size);
+        if (::compress2(compressed.data(), &size, raw.data(), raw.size(),
+                        Z_DEFAULT_COMPRESSION) != Z_OK) {
+            ok = false;
+            return;
+        }
+        offsets[t] = end.fetch_add(size);
+        byte_counts[t] = size;
+        if (::pwrite(fd, compressed.data(), size, offsets[t]) !=
+            static_cast<ssize_t>(size)) {
+            ok = false;
+        }
+    });
+
+    // the directory, with its tile offset and byte count arrays after it
+    // if there is more than one tile
+    constexpr std::uint64_t n_entries = 13;
+    const std::uint64_t ifd_offset = (end + 7) & ~std::uint64_t(7);
+    const std::uint64_t offsets_at = ifd_offset + 8 + n_entries * 20 + 8;
+    const std::uint64_t byte_counts_at = offsets_at + n_tiles * 8;
+    tiff_buffer ifd;
+    ifd.put(n_entries);
+    ifd.entry(256, 4, width);   // ImageWidth
+    ifd.entry(257, 4, height);  // ImageLength
+    ifd.entry(258, 3, bits);    // BitsPerSample
+    ifd.entry(259, 3, 8);       // Compression: deflate
+    ifd.entry(262, 3, 1);       // PhotometricInterpretation: black is zero
+    ifd.entry(277, 3, 1);       // SamplesPerPixel
+    ifd.entry(284, 3, 1);       // PlanarConfiguration: chunky
+    ifd.entry(317, 3, bits == 16 ? 2 : 1);  // Predictor
+    ifd.entry(322, 4, tile);                // TileWidth
+    ifd.entry(323, 4, tile);                // TileLength
+    ifd.array_entry(324, offsets, offsets_at);          // TileOffsets
+    ifd.array_entry(325, byte_counts, byte_counts_at);  // TileByteCounts
+    ifd.entry(339, 3, bits == 16 ? 1 : 3);  // SampleFormat: uint or float
+    ifd.put(std::uint64_t(0));              // no next directory
+    if (n_tiles > 1) {
+        for (const std::uint64_t x : offsets) ifd.put(x);
+        for (const std::uint64_t x : byte_counts) ifd.put(x);
+    }
+
+    tiff_buffer header;
+    header.bytes = {'I', 'I'};
+    header.put(std::uint16_t(43));  // BigTIFF
+    header.put(std::uint16_t(8));   // bytes per offset
+    header.put(std::uint16_t(0));
+    header.put(ifd_offset);
+
+    ok = ok &&
+         ::pwrite(fd, ifd.bytes.data(), ifd.bytes.size(), ifd_offset) ==
+             static_cast<ssize_t>(ifd.bytes.size()) &&
+         ::pwrite(fd, header.bytes.data(), header.bytes.size(), 0) ==
+             static_cast<ssize_t>(header.bytes.size());
+    return ::close(fd) == 0 && ok;
+}
+
+}  // namespace buddha
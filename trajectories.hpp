@@ -0,0 +1,163 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buddhabrot.hpp"
+
+namespace buddha {
+
+/**
+ * Streams escaping orbits to a binary file for external analysis.
+ *
+ * The file starts with the magic "BUDTRAJ1", then two little-endian int64s:
+ * whether records include their points, and the fixed point scale of the
+ * points. Each record is then
+ *
+ *   varint   n, the number of orbit points splatted (the escape time)
+ *   float32  c.real, c.imag
+ *   float32  weight the orbit was splatted with
+ *   n times, if points are included:
+ *     zigzag varint x, y: the point times the scale, rounded, as a delta
+ *                         from the previous point of the orbit (or from 0)
+ *
+ * Records are encoded into one buffer while the other is being written by a
+ * background thread, so the renderer rarely waits on the disk.
+ */
+class trajectory_writer {
+   private:
+    static constexpr std::size_t buffer_size = 4 << 20;
+    static constexpr std::size_t max_varint = 10;
+    static constexpr double scale = 1 << 20;
+
+    const bool with_points;
+    std::ofstream out;
+
+    // front is being filled up to front_used, while back (back_used bytes)
+    // is being written
+    std::vector<char> front, back;
+    std::size_t front_used = 0, back_used = 0;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool back_full = false;
+    bool stopping = false;
+    bool failed = false;
+    std::thread writer;
+
+    static char* put_varint(char* p, std::uint64_t x) {
+        while (x >= 0x80) {
+            *p++ = static_cast<char>(x | 0x80);
+            x >>= 7;
+        }
+        *p++ = static_cast<char>(x);
+        return p;
+    }
+
+    static char* put_zigzag(char* p, const std::int64_t x) {
+        return put_varint(p, (static_cast<std::uint64_t>(x) << 1) ^
+                                 static_cast<std::uint64_t>(x >> 63));
+    }
+
+    static char* put_float(char* p, const float x) {
+        std::memcpy(p, &x, sizeof(x));
+        return p + sizeof(x);
+    }
+
+    /**
+     * hand the front buffer to the writer thread, once it is done with the
+     * previous one
+     */
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return !back_full; });
+        front.swap(back);
+        back_used = front_used;
+        front_used = 0;
+        back_full = true;
+        cv.notify_all();
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&]() { return back_full || stopping; });
+            if (!back_full) return;
+            lock.unlock();
+            out.write(back.data(), back_used);
+            lock.lock();
+            failed = failed || !out;
+            back_full = false;
+            cv.notify_all();
+        }
+    }
+
+   public:
+    trajectory_writer(const std::string& filename, const bool with_points_)
+        : with_points(with_points_),
+          out(filename, std::ios::binary),
+          front(buffer_size),
+          back(buffer_size) {
+        const std::int64_t header[2] = {with_points,
+                                        static_cast<std::int64_t>(scale)};
+        out.write("BUDTRAJ1", 8);
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        writer = std::thread([this]() { write_loop(); });
+    }
+
+    ~trajectory_writer() { close(); }
+
+    /**
+     * write out everything and stop the writer thread. Returns false if
+     * anything failed to write.
+     */
+    bool close() {
+        if (writer.joinable()) {
+            flush();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            writer.join();
+            out.close();
+        }
+        return !failed && !out.fail();
+    }
+
+    explicit operator bool() const { return static_cast<bool>(out); }
+
+    void add(const pt c, const double weight, const pt* points, const idx n) {
+        const std::size_t worst = max_varint + 3 * sizeof(float) +
+                                  (with_points ? n * 2 * max_varint : 0);
+        if (front_used + worst > front.size()) {
+            flush();
+            if (worst > front.size()) front.resize(worst);
+        }
+        char* p = front.data() + front_used;
+        p = put_varint(p, n);
+        p = put_float(p, c.real());
+        p = put_float(p, c.imag());
+        p = put_float(p, weight);
+        if (with_points) {
+            std::int64_t x = 0, y = 0;
+            for (idx i = 0; i < n; i++) {
+                const std::int64_t qx = std::llround(points[i].real() * scale);
+                const std::int64_t qy = std::llround(points[i].imag() * scale);
+                p = put_zigzag(p, qx - x);
+                p = put_zigzag(p, qy - y);
+                x = qx;
+                y = qy;
+            }
+        }
+        front_used = p - front.data();
+    }
+};
+
+}  // namespace buddha